@@ -2,19 +2,86 @@
 #define KABSCH_HPP
 
 #include <Eigen/Geometry>
+#include <Eigen/Eigenvalues>
 
 // This code is released in public domain
 
-#include "Kabsch.hpp"
-
 // Given two sets of 3D points, find the rotation + translation + scale
 // which best maps the first set to the second.
 // Source: http://en.wikipedia.org/wiki/Kabsch_algorithm
 
 // The input 3D points are stored as columns.
-Eigen::Affine3d Find3DAffineTransform(Eigen::Matrix3Xd in, Eigen::Matrix3Xd out);
+Eigen::Affine3d Find3DAffineTransform(const Eigen::Matrix3Xd &in, const Eigen::Matrix3Xd &out);
+
+// Same, for a number of points known at compile time, such as
+// Eigen::Matrix<double, 3, 10> for ref.landmarks. Does not allocate.
+template <int N>
+Eigen::Affine3d Find3DAffineTransform(const Eigen::Matrix<double, 3, N> &in,
+                                      const Eigen::Matrix<double, 3, N> &out);
+
+// The rotation R maximising trace(R * cov), i.e. the best rotation from
+// centred points a to centred points b given cov = sum(a * b^T), by Horn's
+// quaternion method: a fixed-size 4x4 symmetric eigenproblem instead of
+// an SVD.
+Eigen::Matrix3d FindRotationFromCovariance(const Eigen::Matrix3d &cov);
 
 // A function to test Find3DAffineTransform()
 void TestFind3DAffineTransform();
 
-#endif
\ No newline at end of file
+
+
+// Templated implementation, shared by the dynamic and fixed-size versions.
+// Works on the points in place through two passes over the columns.
+template <typename Derived>
+Eigen::Affine3d Find3DAffineTransformImpl(const Eigen::MatrixBase<Derived> &in,
+                                          const Eigen::MatrixBase<Derived> &out)
+{
+  // Default output
+  Eigen::Affine3d A;
+  A.linear() = Eigen::Matrix3d::Identity(3, 3);
+  A.translation() = Eigen::Vector3d::Zero();
+
+  if (in.cols() != out.cols())
+    throw "Find3DAffineTransform(): input data mis-match";
+
+  // First find the scale, by finding the ratio of sums of some distances.
+  // Find the centroids at the same time.
+  double dist_in = 0, dist_out = 0;
+  Eigen::Vector3d in_ctr = Eigen::Vector3d::Zero();
+  Eigen::Vector3d out_ctr = Eigen::Vector3d::Zero();
+  for (int col = 0; col < in.cols(); col++) {
+    if (col + 1 < in.cols()) {
+      dist_in  += (in.col(col+1) - in.col(col)).norm();
+      dist_out += (out.col(col+1) - out.col(col)).norm();
+    }
+    in_ctr  += in.col(col);
+    out_ctr += out.col(col);
+  }
+  if (dist_in <= 0 || dist_out <= 0)
+    return A;
+  double scale = dist_out/dist_in;
+  in_ctr /= in.cols();
+  out_ctr /= out.cols();
+
+  // Covariance of the centred points; the scale does not change the rotation
+  Eigen::Matrix3d Cov = Eigen::Matrix3d::Zero();
+  for (int col = 0; col < in.cols(); col++)
+    Cov += (in.col(col) - in_ctr) * (out.col(col) - out_ctr).transpose();
+
+  Eigen::Matrix3d R = FindRotationFromCovariance(Cov);
+
+  // The final transform
+  A.linear() = scale * R;
+  A.translation() = out_ctr - scale*R*in_ctr;
+
+  return A;
+}
+
+template <int N>
+Eigen::Affine3d Find3DAffineTransform(const Eigen::Matrix<double, 3, N> &in,
+                                      const Eigen::Matrix<double, 3, N> &out)
+{
+  return Find3DAffineTransformImpl(in, out);
+}
+
+#endif
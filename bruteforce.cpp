@@ -0,0 +1,218 @@
+#include "bruteforce.hpp"
+#include <cfloat>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BRUTEFORCE_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+    typedef int (*Kernel)(const float *x, const float *y, const float *z, unsigned long count,
+                          const glm::vec3 &query, float *distance2);
+
+    // The kernels keep the best squared distance and index per lane, lane j
+    // seeing points j, j + 16, ..., so a strict '<' per lane plus a lowest
+    // index tie break across lanes gives the same answer as a linear scan.
+    // Distances are summed as (dx*dx + dy*dy) + dz*dz without fused
+    // multiply-adds, exactly as glm::dot does.
+    int reduceLanes(const float *best, const int *index, float *distance2)
+    {
+        float bestScore = FLT_MAX;
+        int bestIndex = -1;
+        for (unsigned int j = 0; j < BruteForceIndex::BLOCK; j++)
+        {
+            if (index[j] < 0)
+                continue;
+            if (best[j] < bestScore || (best[j] == bestScore && index[j] < bestIndex))
+            {
+                bestScore = best[j];
+                bestIndex = index[j];
+            }
+        }
+        if (distance2)
+            *distance2 = bestScore;
+        return bestIndex;
+    }
+
+    int nearestScalar(const float *x, const float *y, const float *z, unsigned long count,
+                      const glm::vec3 &query, float *distance2)
+    {
+        float best[BruteForceIndex::BLOCK];
+        int index[BruteForceIndex::BLOCK];
+        for (unsigned int j = 0; j < BruteForceIndex::BLOCK; j++)
+        {
+            best[j] = FLT_MAX;
+            index[j] = -1;
+        }
+        for (unsigned long i = 0; i < count; i += BruteForceIndex::BLOCK)
+        {
+            for (unsigned int j = 0; j < BruteForceIndex::BLOCK; j++)
+            {
+                float dx = x[i + j] - query.x;
+                float dy = y[i + j] - query.y;
+                float dz = z[i + j] - query.z;
+                float score = dx * dx + dy * dy + dz * dz;
+                if (score < best[j])
+                {
+                    best[j] = score;
+                    index[j] = (int) (i + j);
+                }
+            }
+        }
+        return reduceLanes(best, index, distance2);
+    }
+
+#ifdef BRUTEFORCE_X86
+    // One 4-lane step. The running minimum comes from min, keeping the
+    // dependency between steps short; SSE2 has no blend, so the indices are
+    // selected with and/andnot/or.
+    __attribute__((target("sse2"), always_inline))
+    inline void stepSSE2(const float *x, const float *y, const float *z, __m128 qx, __m128 qy, __m128 qz,
+                         __m128i step, __m128 &best, __m128i &index, __m128i &lane)
+    {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(x), qx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(y), qy);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(z), qz);
+        __m128 score = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128 closer = _mm_cmplt_ps(score, best);
+        __m128i closerMask = _mm_castps_si128(closer);
+        best = _mm_min_ps(score, best);
+        index = _mm_or_si128(_mm_and_si128(closerMask, lane), _mm_andnot_si128(closerMask, index));
+        lane = _mm_add_epi32(lane, step);
+    }
+
+    // four independent accumulators, so consecutive steps overlap
+    __attribute__((target("sse2")))
+    int nearestSSE2(const float *x, const float *y, const float *z, unsigned long count,
+                    const glm::vec3 &query, float *distance2)
+    {
+        __m128 qx = _mm_set1_ps(query.x);
+        __m128 qy = _mm_set1_ps(query.y);
+        __m128 qz = _mm_set1_ps(query.z);
+        __m128i step = _mm_set1_epi32(BruteForceIndex::BLOCK);
+        __m128 best0 = _mm_set1_ps(FLT_MAX), best1 = best0, best2 = best0, best3 = best0;
+        __m128i index0 = _mm_set1_epi32(-1), index1 = index0, index2 = index0, index3 = index0;
+        __m128i lane0 = _mm_setr_epi32(0, 1, 2, 3);
+        __m128i lane1 = _mm_setr_epi32(4, 5, 6, 7);
+        __m128i lane2 = _mm_setr_epi32(8, 9, 10, 11);
+        __m128i lane3 = _mm_setr_epi32(12, 13, 14, 15);
+
+        for (unsigned long i = 0; i < count; i += BruteForceIndex::BLOCK)
+        {
+            stepSSE2(x + i, y + i, z + i, qx, qy, qz, step, best0, index0, lane0);
+            stepSSE2(x + i + 4, y + i + 4, z + i + 4, qx, qy, qz, step, best1, index1, lane1);
+            stepSSE2(x + i + 8, y + i + 8, z + i + 8, qx, qy, qz, step, best2, index2, lane2);
+            stepSSE2(x + i + 12, y + i + 12, z + i + 12, qx, qy, qz, step, best3, index3, lane3);
+        }
+
+        float bestLanes[BruteForceIndex::BLOCK];
+        int indexLanes[BruteForceIndex::BLOCK];
+        _mm_storeu_ps(bestLanes, best0);
+        _mm_storeu_ps(bestLanes + 4, best1);
+        _mm_storeu_ps(bestLanes + 8, best2);
+        _mm_storeu_ps(bestLanes + 12, best3);
+        _mm_storeu_si128((__m128i *) indexLanes, index0);
+        _mm_storeu_si128((__m128i *) (indexLanes + 4), index1);
+        _mm_storeu_si128((__m128i *) (indexLanes + 8), index2);
+        _mm_storeu_si128((__m128i *) (indexLanes + 12), index3);
+        return reduceLanes(bestLanes, indexLanes, distance2);
+    }
+
+    // one 8-lane step
+    __attribute__((target("avx2"), always_inline))
+    inline void stepAVX2(const float *x, const float *y, const float *z, __m256 qx, __m256 qy, __m256 qz,
+                         __m256i step, __m256 &best, __m256i &index, __m256i &lane)
+    {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x), qx);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y), qy);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z), qz);
+        __m256 score = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+                                     _mm256_mul_ps(dz, dz));
+        __m256 closer = _mm256_cmp_ps(score, best, _CMP_LT_OQ);
+        best = _mm256_min_ps(score, best);
+        index = _mm256_blendv_epi8(index, lane, _mm256_castps_si256(closer));
+        lane = _mm256_add_epi32(lane, step);
+    }
+
+    // two independent accumulators
+    __attribute__((target("avx2")))
+    int nearestAVX2(const float *x, const float *y, const float *z, unsigned long count,
+                    const glm::vec3 &query, float *distance2)
+    {
+        __m256 qx = _mm256_set1_ps(query.x);
+        __m256 qy = _mm256_set1_ps(query.y);
+        __m256 qz = _mm256_set1_ps(query.z);
+        __m256i step = _mm256_set1_epi32(BruteForceIndex::BLOCK);
+        __m256 best0 = _mm256_set1_ps(FLT_MAX), best1 = best0;
+        __m256i index0 = _mm256_set1_epi32(-1), index1 = index0;
+        __m256i lane0 = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i lane1 = _mm256_setr_epi32(8, 9, 10, 11, 12, 13, 14, 15);
+
+        for (unsigned long i = 0; i < count; i += BruteForceIndex::BLOCK)
+        {
+            stepAVX2(x + i, y + i, z + i, qx, qy, qz, step, best0, index0, lane0);
+            stepAVX2(x + i + 8, y + i + 8, z + i + 8, qx, qy, qz, step, best1, index1, lane1);
+        }
+
+        float bestLanes[BruteForceIndex::BLOCK];
+        int indexLanes[BruteForceIndex::BLOCK];
+        _mm256_storeu_ps(bestLanes, best0);
+        _mm256_storeu_ps(bestLanes + 8, best1);
+        _mm256_storeu_si256((__m256i *) indexLanes, index0);
+        _mm256_storeu_si256((__m256i *) (indexLanes + 8), index1);
+        return reduceLanes(bestLanes, indexLanes, distance2);
+    }
+#endif
+
+    Kernel selectKernel(const char **name)
+    {
+#ifdef BRUTEFORCE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            *name = "AVX2";
+            return nearestAVX2;
+        }
+        if (__builtin_cpu_supports("sse2"))
+        {
+            *name = "SSE2";
+            return nearestSSE2;
+        }
+#endif
+        *name = "scalar";
+        return nearestScalar;
+    }
+
+    const char *s_kernelName = 0;
+    Kernel s_kernel = selectKernel(&s_kernelName);
+}
+
+const char *BruteForceIndex::kernelName()
+{
+    return s_kernelName;
+}
+
+void BruteForceIndex::build(const std::vector<glm::vec3> &points)
+{
+    m_size = points.size();
+    unsigned long padded = (m_size + BLOCK - 1) / BLOCK * BLOCK;
+    m_x.assign(padded, FLT_MAX);
+    m_y.assign(padded, FLT_MAX);
+    m_z.assign(padded, FLT_MAX);
+    for (unsigned long i = 0; i < m_size; i++)
+    {
+        m_x[i] = points[i].x;
+        m_y[i] = points[i].y;
+        m_z[i] = points[i].z;
+    }
+}
+
+int BruteForceIndex::nearest(const glm::vec3 &query, float *distance2) const
+{
+    if (m_size == 0)
+        return -1;
+    return s_kernel(&m_x[0], &m_y[0], &m_z[0], m_x.size(), query, distance2);
+}
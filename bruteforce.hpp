@@ -0,0 +1,39 @@
+#ifndef BRUTEFORCE_HPP
+#define BRUTEFORCE_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "spatialindex.hpp"
+
+// Exhaustive nearest neighbour search. The points are kept as separate x,
+// y and z arrays and scanned 16 at a time with AVX2 or SSE2, whichever the
+// CPU supports, picked at run time. Building is just the copy, which makes
+// this the quickest backend for small point sets queried a few times, and
+// the reference the other backends are checked against.
+class BruteForceIndex : public SpatialIndex
+{
+public:
+    BruteForceIndex() {}
+    BruteForceIndex(const std::vector<glm::vec3> &points) { build(points); }
+    ~BruteForceIndex() {}
+
+    void build(const std::vector<glm::vec3> &points);
+    int nearest(const glm::vec3 &query, float *distance2 = (float*) 0) const;
+    unsigned long size() const { return m_size; }
+
+    // the instruction set used by nearest(): "AVX2", "SSE2" or "scalar"
+    static const char *kernelName();
+
+    // points scanned per step; the arrays are padded to a multiple of it
+    static const unsigned int BLOCK = 16;
+
+private:
+    // padding points sit at FLT_MAX, where they never win
+    std::vector<float> m_x;
+    std::vector<float> m_y;
+    std::vector<float> m_z;
+    unsigned long m_size = 0;
+};
+
+#endif
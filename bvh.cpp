@@ -0,0 +1,387 @@
+#include "bvh.hpp"
+#include <algorithm>
+#include <cfloat>
+
+using namespace std;
+
+namespace
+{
+    const unsigned int MAX_DEPTH = 60;     // keeps the query stack bounded
+
+    const char MAGIC[8] = { 'T', 'R', 'I', 'B', 'V', 'H', '0', '1' };
+
+    enum { NODES, TRIANGLES, INDICES, SLOTS, NUM_ARRAYS };
+
+    float surfaceArea(const glm::vec3 &lo, const glm::vec3 &hi)
+    {
+        glm::vec3 d = hi - lo;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    float boxDistance2(const glm::vec3 &lo, const glm::vec3 &hi, const glm::vec3 &p)
+    {
+        glm::vec3 d = glm::max(glm::max(lo - p, p - hi), glm::vec3(0.0f));
+        return glm::dot(d, d);
+    }
+
+    // Closest point on triangle abc to p, as barycentric weights (Ericson,
+    // Real-Time Collision Detection, 5.1.5). Degenerate triangles fall back
+    // to their nearest corner.
+    glm::vec3 closestBarycentric(const glm::vec3 &p, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c)
+    {
+        glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+        float d1 = glm::dot(ab, ap);
+        float d2 = glm::dot(ac, ap);
+        if (d1 <= 0.0f && d2 <= 0.0f)
+            return glm::vec3(1.0f, 0.0f, 0.0f);
+
+        glm::vec3 bp = p - b;
+        float d3 = glm::dot(ab, bp);
+        float d4 = glm::dot(ac, bp);
+        if (d3 >= 0.0f && d4 <= d3)
+            return glm::vec3(0.0f, 1.0f, 0.0f);
+
+        float vc = d1 * d4 - d3 * d2;
+        if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f && d1 - d3 > 0.0f)
+        {
+            float v = d1 / (d1 - d3);
+            return glm::vec3(1.0f - v, v, 0.0f);
+        }
+
+        glm::vec3 cp = p - c;
+        float d5 = glm::dot(ab, cp);
+        float d6 = glm::dot(ac, cp);
+        if (d6 >= 0.0f && d5 <= d6)
+            return glm::vec3(0.0f, 0.0f, 1.0f);
+
+        float vb = d5 * d2 - d1 * d6;
+        if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f && d2 - d6 > 0.0f)
+        {
+            float w = d2 / (d2 - d6);
+            return glm::vec3(1.0f - w, 0.0f, w);
+        }
+
+        float va = d3 * d6 - d5 * d4;
+        if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f && (d4 - d3) + (d5 - d6) > 0.0f)
+        {
+            float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+            return glm::vec3(0.0f, 1.0f - w, w);
+        }
+
+        float sum = va + vb + vc;
+        if (sum > 0.0f)
+        {
+            float v = vb / sum;
+            float w = vc / sum;
+            return glm::vec3(1.0f - v - w, v, w);
+        }
+
+        glm::vec3 da = p - a, db = p - b, dc = p - c;
+        float sa = glm::dot(da, da), sb = glm::dot(db, db), sc = glm::dot(dc, dc);
+        if (sa <= sb && sa <= sc)
+            return glm::vec3(1.0f, 0.0f, 0.0f);
+        return sb <= sc ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(0.0f, 0.0f, 1.0f);
+    }
+
+    const unsigned int NUM_BINS = 16;
+
+    unsigned int binOf(float x, float lo, float scale)
+    {
+        unsigned int bin = (unsigned int) ((x - lo) * scale);
+        return std::min(bin, NUM_BINS - 1);
+    }
+
+    struct Bin
+    {
+        glm::vec3 lo = glm::vec3(FLT_MAX);
+        glm::vec3 hi = glm::vec3(-FLT_MAX);
+        unsigned int count = 0;
+    };
+
+    struct BelowBin
+    {
+        BelowBin(const std::vector<glm::vec3> &centroids, unsigned int axis, float lo, float scale, unsigned int bin)
+            : m_centroids(centroids), m_axis(axis), m_lo(lo), m_scale(scale), m_bin(bin) {}
+        bool operator()(unsigned int t) const { return binOf(m_centroids[t][m_axis], m_lo, m_scale) < m_bin; }
+        const std::vector<glm::vec3> &m_centroids;
+        unsigned int m_axis;
+        float m_lo;
+        float m_scale;
+        unsigned int m_bin;
+    };
+}
+
+void TriangleBVH::build(const std::vector<glm::vec3> &positions, const std::vector<unsigned int> &indices)
+{
+    m_file.close();
+    m_nodes.clear();
+    m_triangles.clear();
+    m_indices.clear();
+    m_slots.clear();
+    useVectors();
+
+    unsigned int numTriangles = (unsigned int) ((indices.empty() ? positions.size() : indices.size()) / 3);
+    if (numTriangles == 0)
+        return;
+
+    std::vector<Triangle> triangles(numTriangles);
+    std::vector<glm::vec3> centroids(numTriangles);
+    std::vector<unsigned int> order(numTriangles);
+    for (unsigned int t = 0; t < numTriangles; t++)
+    {
+        triangles[t].a = positions[indices.empty() ? 3 * t : indices[3 * t]];
+        triangles[t].b = positions[indices.empty() ? 3 * t + 1 : indices[3 * t + 1]];
+        triangles[t].c = positions[indices.empty() ? 3 * t + 2 : indices[3 * t + 2]];
+        centroids[t] = (triangles[t].a + triangles[t].b + triangles[t].c) / 3.0f;
+        order[t] = t;
+    }
+
+    m_nodes.reserve(2 * numTriangles);
+    buildNode(0, numTriangles, 0, order, triangles, centroids);
+
+    m_triangles.resize(numTriangles);
+    m_indices.resize(numTriangles);
+    m_slots.resize(numTriangles);
+    for (unsigned int i = 0; i < numTriangles; i++)
+    {
+        m_triangles[i] = triangles[order[i]];
+        m_indices[i] = order[i];
+        m_slots[order[i]] = i;
+    }
+    useVectors();
+}
+
+void TriangleBVH::useVectors()
+{
+    m_nodeData = m_nodes.data();
+    m_triangleData = m_triangles.data();
+    m_indexData = m_indices.data();
+    m_slotData = m_slots.data();
+    m_numNodes = m_nodes.size();
+    m_numTriangles = m_triangles.size();
+}
+
+bool TriangleBVH::save(const char *path, uint64_t key) const
+{
+    const void *arrays[NUM_ARRAYS] = { m_nodeData, m_triangleData, m_indexData, m_slotData };
+    size_t sizes[NUM_ARRAYS] = { m_numNodes * sizeof(Node), m_numTriangles * sizeof(Triangle),
+                                 m_numTriangles * sizeof(int), m_numTriangles * sizeof(unsigned int) };
+    return IndexFile::write(path, MAGIC, key, NUM_ARRAYS, arrays, sizes);
+}
+
+// Maps a saved hierarchy in place of the current one; on failure it is empty
+bool TriangleBVH::load(const char *path, uint64_t key)
+{
+    build(std::vector<glm::vec3>(), std::vector<unsigned int>());
+    if (!m_file.open(path, MAGIC, key, NUM_ARRAYS))
+        return false;
+    unsigned long numNodes = m_file.size(NODES) / sizeof(Node);
+    unsigned long numTriangles = m_file.size(TRIANGLES) / sizeof(Triangle);
+    if (numNodes == 0 ||
+        m_file.size(NODES) != numNodes * sizeof(Node) ||
+        m_file.size(TRIANGLES) != numTriangles * sizeof(Triangle) ||
+        m_file.size(INDICES) != numTriangles * sizeof(int) ||
+        m_file.size(SLOTS) != numTriangles * sizeof(unsigned int))
+    {
+        m_file.close();
+        return false;
+    }
+
+    m_nodeData = (const Node *) m_file.array(NODES);
+    m_triangleData = (const Triangle *) m_file.array(TRIANGLES);
+    m_indexData = (const int *) m_file.array(INDICES);
+    m_slotData = (const unsigned int *) m_file.array(SLOTS);
+    m_numNodes = numNodes;
+    m_numTriangles = numTriangles;
+    return true;
+}
+
+unsigned int TriangleBVH::buildNode(unsigned int begin, unsigned int end, unsigned int depth,
+                                    std::vector<unsigned int> &order, const std::vector<Triangle> &triangles,
+                                    const std::vector<glm::vec3> &centroids)
+{
+    unsigned int nodeIndex = (unsigned int) m_nodes.size();
+    m_nodes.push_back(Node());
+
+    glm::vec3 lo(FLT_MAX), hi(-FLT_MAX), centroidLo(FLT_MAX), centroidHi(-FLT_MAX);
+    for (unsigned int i = begin; i < end; i++)
+    {
+        const Triangle &t = triangles[order[i]];
+        lo = glm::min(lo, glm::min(t.a, glm::min(t.b, t.c)));
+        hi = glm::max(hi, glm::max(t.a, glm::max(t.b, t.c)));
+        centroidLo = glm::min(centroidLo, centroids[order[i]]);
+        centroidHi = glm::max(centroidHi, centroids[order[i]]);
+    }
+    m_nodes[nodeIndex].lo = lo;
+    m_nodes[nodeIndex].hi = hi;
+    m_nodes[nodeIndex].first = begin;
+    m_nodes[nodeIndex].count = end - begin;
+
+    unsigned int count = end - begin;
+    if (count <= 2 || depth >= MAX_DEPTH)
+        return nodeIndex;
+
+    // cheapest split between bins of centroids, by surface area heuristic:
+    // a triangle costs as much to test as a node
+    float bestCost = FLT_MAX;
+    unsigned int bestAxis = 0, bestBin = 0;
+    for (unsigned int axis = 0; axis < 3; axis++)
+    {
+        float extent = centroidHi[axis] - centroidLo[axis];
+        if (extent <= 0.0f)
+            continue;
+        float scale = NUM_BINS / extent;
+
+        Bin bins[NUM_BINS];
+        for (unsigned int i = begin; i < end; i++)
+        {
+            const Triangle &t = triangles[order[i]];
+            Bin &bin = bins[binOf(centroids[order[i]][axis], centroidLo[axis], scale)];
+            bin.lo = glm::min(bin.lo, glm::min(t.a, glm::min(t.b, t.c)));
+            bin.hi = glm::max(bin.hi, glm::max(t.a, glm::max(t.b, t.c)));
+            bin.count++;
+        }
+
+        // areas and counts left of each boundary, then sweep from the right
+        float leftArea[NUM_BINS];
+        unsigned int leftCount[NUM_BINS];
+        glm::vec3 boxLo(FLT_MAX), boxHi(-FLT_MAX);
+        unsigned int n = 0;
+        for (unsigned int b = 1; b < NUM_BINS; b++)
+        {
+            boxLo = glm::min(boxLo, bins[b - 1].lo);
+            boxHi = glm::max(boxHi, bins[b - 1].hi);
+            n += bins[b - 1].count;
+            leftArea[b] = n ? surfaceArea(boxLo, boxHi) : 0.0f;
+            leftCount[b] = n;
+        }
+        boxLo = glm::vec3(FLT_MAX);
+        boxHi = glm::vec3(-FLT_MAX);
+        n = 0;
+        for (unsigned int b = NUM_BINS - 1; b > 0; b--)
+        {
+            boxLo = glm::min(boxLo, bins[b].lo);
+            boxHi = glm::max(boxHi, bins[b].hi);
+            n += bins[b].count;
+            if (n == 0 || leftCount[b] == 0)
+                continue;
+            float cost = leftArea[b] * leftCount[b] + surfaceArea(boxLo, boxHi) * n;
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+        }
+    }
+
+    float area = surfaceArea(lo, hi);
+    float leafCost = area * count;
+    unsigned int mid;
+    if (bestCost < FLT_MAX && (area + bestCost < leafCost || count > MAX_LEAF_SIZE))
+    {
+        float scale = NUM_BINS / (centroidHi[bestAxis] - centroidLo[bestAxis]);
+        mid = (unsigned int) (std::partition(order.begin() + begin, order.begin() + end,
+                                             BelowBin(centroids, bestAxis, centroidLo[bestAxis], scale, bestBin))
+                              - order.begin());
+    }
+    else if (count > MAX_LEAF_SIZE)
+    {
+        // all centroids coincide; any split will do
+        mid = begin + count / 2;
+    }
+    else
+        return nodeIndex;
+
+    m_nodes[nodeIndex].count = 0;
+    buildNode(begin, mid, depth + 1, order, triangles, centroids);
+    unsigned int right = buildNode(mid, end, depth + 1, order, triangles, centroids);
+    m_nodes[nodeIndex].first = right;
+    return nodeIndex;
+}
+
+bool TriangleBVH::closestPoint(const glm::vec3 &query, SurfacePoint &result, int hint, float epsilon) const
+{
+    if (m_numNodes == 0)
+        return false;
+
+    float bestScore = FLT_MAX;
+    int bestIndex = -1;
+    glm::vec3 bestPoint, bestBarycentric;
+    if (hint >= 0 && hint < (int) m_numTriangles)
+    {
+        const Triangle &t = m_triangleData[m_slotData[hint]];
+        bestBarycentric = closestBarycentric(query, t.a, t.b, t.c);
+        bestPoint = t.a * bestBarycentric.x + t.b * bestBarycentric.y + t.c * bestBarycentric.z;
+        glm::vec3 diff = bestPoint - query;
+        bestScore = glm::dot(diff, diff);
+        bestIndex = hint;
+    }
+    // boxes are compared against the best distance shrunk by (1 + epsilon)^2;
+    // exactly 1 for an exact search
+    float shrink = 1.0f / ((1.0f + epsilon) * (1.0f + epsilon));
+
+    // (node, squared distance from query to its box)
+    unsigned int stackNode[MAX_DEPTH + 4];
+    float stackBound[MAX_DEPTH + 4];
+    int top = 0;
+    stackNode[top] = 0;
+    stackBound[top] = boxDistance2(m_nodeData[0].lo, m_nodeData[0].hi, query);
+    top++;
+
+    while (top > 0)
+    {
+        top--;
+        // '<=' rather than '<' so that equally close triangles with a lower index are still found
+        if (stackBound[top] > bestScore * shrink)
+            continue;
+        unsigned int n = stackNode[top];
+        const Node &node = m_nodeData[n];
+
+        if (node.count > 0)
+        {
+            for (unsigned int i = node.first; i < node.first + node.count; i++)
+            {
+                const Triangle &t = m_triangleData[i];
+                glm::vec3 barycentric = closestBarycentric(query, t.a, t.b, t.c);
+                glm::vec3 point = t.a * barycentric.x + t.b * barycentric.y + t.c * barycentric.z;
+                glm::vec3 diff = point - query;
+                float score = glm::dot(diff, diff);
+                if (score < bestScore || (score == bestScore && m_indexData[i] < bestIndex))
+                {
+                    bestScore = score;
+                    bestIndex = m_indexData[i];
+                    bestPoint = point;
+                    bestBarycentric = barycentric;
+                }
+            }
+            continue;
+        }
+
+        // visit the nearer child first
+        unsigned int left = n + 1, right = node.first;
+        float leftBound = boxDistance2(m_nodeData[left].lo, m_nodeData[left].hi, query);
+        float rightBound = boxDistance2(m_nodeData[right].lo, m_nodeData[right].hi, query);
+        bool leftFirst = leftBound <= rightBound;
+        float farBound = leftFirst ? rightBound : leftBound;
+        float nearBound = leftFirst ? leftBound : rightBound;
+        if (farBound <= bestScore * shrink)
+        {
+            stackNode[top] = leftFirst ? right : left;
+            stackBound[top] = farBound;
+            top++;
+        }
+        if (nearBound <= bestScore * shrink)
+        {
+            stackNode[top] = leftFirst ? left : right;
+            stackBound[top] = nearBound;
+            top++;
+        }
+    }
+
+    result.triangle = bestIndex;
+    result.position = bestPoint;
+    result.barycentric = bestBarycentric;
+    result.distance2 = bestScore;
+    return true;
+}
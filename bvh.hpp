@@ -0,0 +1,88 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <stdint.h>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "indexfile.hpp"
+
+// A point on a triangle mesh surface
+struct SurfacePoint
+{
+    int triangle = -1;          // index of the triangle in the mesh, -1 if none
+    glm::vec3 position;
+    glm::vec3 barycentric;      // weights of the triangle's three corners
+    float distance2 = 0.0f;     // squared distance from the query
+};
+
+// Bounding volume hierarchy over the triangles of a mesh, for closest point
+// on surface queries. Built top down with the surface area heuristic over
+// binned centroids; nodes and triangles live in flat arrays, as in KDTree,
+// so a hierarchy is built once and queried from any number of threads, and
+// can be saved to a file and mapped back as it is.
+class TriangleBVH
+{
+public:
+    TriangleBVH() {}
+    ~TriangleBVH() {}
+
+    // indices holds three corners per triangle; if it is empty, every three
+    // consecutive positions form a triangle
+    void build(const std::vector<glm::vec3> &positions, const std::vector<unsigned int> &indices);
+
+    // Finds the closest point to query on any triangle. Of equally close
+    // triangles, the lowest numbered one wins. Returns false if the mesh has
+    // no triangles. A hint, the number of a triangle believed to be close,
+    // bounds the search from the start without changing the result. With
+    // epsilon > 0 the point found may be up to 1 + epsilon times further
+    // away than the closest, skipping boxes that could only improve on it
+    // by less.
+    bool closestPoint(const glm::vec3 &query, SurfacePoint &result, int hint = -1, float epsilon = 0.0f) const;
+
+    unsigned long numTriangles() const { return m_numTriangles; }
+    bool empty() const { return m_numTriangles == 0; }
+
+    // as SpatialIndex::save() and load(); key identifies the mesh
+    bool save(const char *path, uint64_t key) const;
+    bool load(const char *path, uint64_t key);
+
+private:
+    TriangleBVH(const TriangleBVH &);
+    TriangleBVH &operator=(const TriangleBVH &);
+
+    static const unsigned int MAX_LEAF_SIZE = 8;
+
+    struct Node
+    {
+        glm::vec3 lo;
+        unsigned int first;     // leaf: first triangle; inner: right child (left is this + 1)
+        glm::vec3 hi;
+        unsigned int count;     // leaf: number of triangles; inner: 0
+    };
+
+    struct Triangle
+    {
+        glm::vec3 a, b, c;
+    };
+
+    unsigned int buildNode(unsigned int begin, unsigned int end, unsigned int depth, std::vector<unsigned int> &order,
+                           const std::vector<Triangle> &triangles, const std::vector<glm::vec3> &centroids);
+    void useVectors();
+
+    std::vector<Node> m_nodes;
+    std::vector<Triangle> m_triangles;     // triangles in hierarchy order
+    std::vector<int> m_indices;            // original index of each triangle in hierarchy order
+    std::vector<unsigned int> m_slots;     // hierarchy order position of each original triangle
+
+    // what queries read: the vectors above, or the same arrays in m_file
+    IndexFile m_file;
+    const Node *m_nodeData = 0;
+    const Triangle *m_triangleData = 0;
+    const int *m_indexData = 0;
+    const unsigned int *m_slotData = 0;
+    unsigned long m_numNodes = 0;
+    unsigned long m_numTriangles = 0;
+};
+
+#endif
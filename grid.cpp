@@ -0,0 +1,219 @@
+#include "grid.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <math.h>
+
+using namespace std;
+
+namespace
+{
+    // cell width in point spacings; wider cells hold more points, narrower
+    // ones make queries visit more (mostly empty) cells
+    const float CELL_SCALE = 1.5f;
+
+    // slack on the distance to unsearched cells, for points that rounding
+    // put in a cell they sit a hair outside of
+    const float BOUND_MARGIN = 1e-4f;
+}
+
+int GridIndex::cellOf(float x, int axis) const
+{
+    int cell = (int) floorf((x - m_lo[axis]) * m_inverseCellSize);
+    return std::min(std::max(cell, 0), m_dims[axis] - 1);
+}
+
+void GridIndex::build(const std::vector<glm::vec3> &points)
+{
+    m_cellStart.clear();
+    m_points.clear();
+    m_indices.clear();
+    m_slots.clear();
+    if (points.empty())
+        return;
+
+    long numPoints = (long) points.size();
+    float loX = FLT_MAX, loY = FLT_MAX, loZ = FLT_MAX;
+    float hiX = -FLT_MAX, hiY = -FLT_MAX, hiZ = -FLT_MAX;
+    long i;
+    #pragma omp parallel for reduction(min:loX, loY, loZ) reduction(max:hiX, hiY, hiZ)
+    for (i = 0; i < numPoints; i++)
+    {
+        loX = std::min(loX, points[i].x);
+        loY = std::min(loY, points[i].y);
+        loZ = std::min(loZ, points[i].z);
+        hiX = std::max(hiX, points[i].x);
+        hiY = std::max(hiY, points[i].y);
+        hiZ = std::max(hiZ, points[i].z);
+    }
+    m_lo = glm::vec3(loX, loY, loZ);
+    glm::vec3 extent = glm::vec3(hiX, hiY, hiZ) - m_lo;
+
+    // without a spacing, take the points to cover the two longest sides of
+    // their box evenly, as a scan does
+    float spacing = m_spacing;
+    if (spacing <= 0.0f)
+    {
+        float sides[3] = { extent.x, extent.y, extent.z };
+        std::sort(sides, sides + 3);
+        spacing = sqrtf(sides[2] * std::max(sides[1], sides[2] * 1e-3f) / numPoints);
+    }
+    m_cellSize = std::max(CELL_SCALE * spacing, 1e-6f * std::max(extent.x, std::max(extent.y, extent.z)));
+    if (!(m_cellSize > 0.0f))
+        m_cellSize = 1.0f;
+    double numCells;
+    for (;;)
+    {
+        numCells = 1.0;
+        for (int a = 0; a < 3; a++)
+        {
+            m_dims[a] = (int) (extent[a] / m_cellSize) + 1;
+            numCells *= m_dims[a];
+        }
+        if (numCells <= (double) MAX_CELLS_PER_POINT * numPoints + 1.0)
+            break;
+        m_cellSize *= 1.25f;
+    }
+    m_inverseCellSize = 1.0f / m_cellSize;
+
+    // counting sort by cell: count, prefix sum, scatter
+    std::vector<unsigned int> cell(numPoints);
+    m_cellStart.assign((size_t) numCells + 1, 0);
+    #pragma omp parallel for
+    for (i = 0; i < numPoints; i++)
+    {
+        const glm::vec3 &p = points[i];
+        cell[i] = (unsigned int) ((cellOf(p.z, 2) * m_dims[1] + cellOf(p.y, 1)) * m_dims[0] + cellOf(p.x, 0));
+        #pragma omp atomic
+        m_cellStart[cell[i] + 1]++;
+    }
+    for (size_t c = 1; c < m_cellStart.size(); c++)
+        m_cellStart[c] += m_cellStart[c - 1];
+
+    std::vector<unsigned int> next(m_cellStart.begin(), m_cellStart.end() - 1);
+    std::vector<unsigned int> order(numPoints);
+    #pragma omp parallel for
+    for (i = 0; i < numPoints; i++)
+    {
+        unsigned int slot;
+        #pragma omp atomic capture
+        slot = next[cell[i]]++;
+        order[slot] = (unsigned int) i;
+    }
+
+    // threads scatter in any order; put each cell back in index order
+    long c;
+    #pragma omp parallel for schedule(dynamic, 4096)
+    for (c = 0; c < (long) numCells; c++)
+        if (m_cellStart[c + 1] - m_cellStart[c] > 1)
+            std::sort(order.begin() + m_cellStart[c], order.begin() + m_cellStart[c + 1]);
+
+    m_points.resize(numPoints);
+    m_indices.resize(numPoints);
+    m_slots.resize(numPoints);
+    #pragma omp parallel for
+    for (i = 0; i < numPoints; i++)
+    {
+        m_points[i] = points[order[i]];
+        m_indices[i] = (int) order[i];
+        m_slots[order[i]] = (unsigned int) i;
+    }
+}
+
+// Scans the points of cells first to last, which are contiguous
+inline void GridIndex::scanCells(unsigned int first, unsigned int last, const glm::vec3 &query,
+                                 float &bestScore, int &bestIndex) const
+{
+    for (unsigned int k = m_cellStart[first]; k < m_cellStart[last + 1]; k++)
+    {
+        glm::vec3 diff = m_points[k] - query;
+        float score = glm::dot(diff, diff);
+        if (score < bestScore || (score == bestScore && m_indices[k] < bestIndex))
+        {
+            bestScore = score;
+            bestIndex = m_indices[k];
+        }
+    }
+}
+
+int GridIndex::nearest(const glm::vec3 &query, float *distance2) const
+{
+    return nearestFrom(query, -1, 0.0f, distance2);
+}
+
+int GridIndex::nearestFrom(const glm::vec3 &query, int hint, float epsilon, float *distance2) const
+{
+    if (m_points.empty())
+        return -1;
+
+    float bestScore = FLT_MAX;
+    int bestIndex = -1;
+    glm::vec3 diff;
+    if (hint >= 0 && hint < (int) m_slots.size())
+    {
+        diff = m_points[m_slots[hint]] - query;
+        bestScore = glm::dot(diff, diff);
+        bestIndex = hint;
+    }
+    // the best distance shrunk by (1 + epsilon)^2; exactly 1 for an exact search
+    float shrink = 1.0f / ((1.0f + epsilon) * (1.0f + epsilon));
+
+    int center[3] = { cellOf(query.x, 0), cellOf(query.y, 1), cellOf(query.z, 2) };
+    // squared distance from the query to the grid along each axis, so queries
+    // far outside it stop as soon as the rest of the grid is out of reach
+    float gap2[3], outside2 = 0.0f;
+    for (int a = 0; a < 3; a++)
+    {
+        float below = m_lo[a] - query[a];
+        float above = query[a] - (m_lo[a] + m_dims[a] * m_cellSize);
+        float gap = std::max(std::max(below, above), 0.0f);
+        gap2[a] = gap * gap;
+        outside2 += gap2[a];
+    }
+    for (int r = 0; ; r++)
+    {
+        // the shell of cells r away from the center: whole rows along x where
+        // y or z is on the shell, otherwise just the two ends of the row
+        int zBegin = std::max(center[2] - r, 0), zEnd = std::min(center[2] + r, m_dims[2] - 1);
+        int yBegin = std::max(center[1] - r, 0), yEnd = std::min(center[1] + r, m_dims[1] - 1);
+        int xBegin = std::max(center[0] - r, 0), xEnd = std::min(center[0] + r, m_dims[0] - 1);
+        for (int z = zBegin; z <= zEnd; z++)
+        {
+            for (int y = yBegin; y <= yEnd; y++)
+            {
+                unsigned int row = (unsigned int) ((z * m_dims[1] + y) * m_dims[0]);
+                if (z == center[2] - r || z == center[2] + r || y == center[1] - r || y == center[1] + r)
+                    scanCells(row + xBegin, row + xEnd, query, bestScore, bestIndex);
+                else
+                {
+                    if (center[0] - r >= 0)
+                        scanCells(row + center[0] - r, row + center[0] - r, query, bestScore, bestIndex);
+                    if (center[0] + r < m_dims[0])
+                        scanCells(row + center[0] + r, row + center[0] + r, query, bestScore, bestIndex);
+                }
+            }
+        }
+
+        // every unsearched point lies beyond a face of the searched block that
+        // still has cells behind it, and inside the grid along the other axes
+        float bound2 = FLT_MAX;
+        for (int a = 0; a < 3; a++)
+        {
+            float face = FLT_MAX;
+            if (center[a] - r > 0)
+                face = query[a] - (m_lo[a] + (center[a] - r) * m_cellSize);
+            if (center[a] + r + 1 < m_dims[a])
+                face = std::min(face, m_lo[a] + (center[a] + r + 1) * m_cellSize - query[a]);
+            if (face == FLT_MAX)
+                continue;
+            face = std::max(face - BOUND_MARGIN * m_cellSize, 0.0f);
+            bound2 = std::min(bound2, face * face + outside2 - gap2[a]);
+        }
+        // the whole grid is searched once no face has cells behind it
+        if (bound2 == FLT_MAX || bound2 > bestScore * shrink)
+            break;
+    }
+
+    if (distance2)
+        *distance2 = bestScore;
+    return bestIndex;
+}
@@ -0,0 +1,58 @@
+#ifndef GRID_HPP
+#define GRID_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "spatialindex.hpp"
+
+// Uniform grid over the bounding box of the points, for nearest neighbour
+// queries on scans: a face is close to a sheet of bounded extent, so a grid
+// with cells about as wide as its edges holds a few points per cell and a
+// query only looks at the cells right around it. Points are counting sorted
+// by cell into flat arrays, in parallel. A query searches shells of cells of
+// growing radius around the query's cell until no unsearched cell can hold
+// anything closer, so results are exact.
+class GridIndex : public SpatialIndex
+{
+public:
+    GridIndex() {}
+    GridIndex(const std::vector<glm::vec3> &points) { build(points); }
+    ~GridIndex() {}
+
+    // cells are a small multiple of this wide; without it the spacing is
+    // guessed from the bounding box
+    void setSpacing(float spacing) { m_spacing = spacing; }
+    void build(const std::vector<glm::vec3> &points);
+    int nearest(const glm::vec3 &query, float *distance2 = (float*) 0) const;
+    // starts with the hint's distance as the search radius, and stops once
+    // the unsearched cells could only improve on it by a factor 1 + epsilon
+    int nearestFrom(const glm::vec3 &query, int hint, float epsilon = 0.0f, float *distance2 = (float*) 0) const;
+    unsigned long size() const { return m_points.size(); }
+
+    float cellSize() const { return m_cellSize; }
+    unsigned long numCells() const { return m_cellStart.empty() ? 0 : m_cellStart.size() - 1; }
+
+private:
+    // cells per point at most; sparser grids get larger cells
+    static const unsigned int MAX_CELLS_PER_POINT = 16;
+
+    int cellOf(float x, int axis) const;
+    void scanCells(unsigned int first, unsigned int last, const glm::vec3 &query,
+                   float &bestScore, int &bestIndex) const;
+
+    float m_spacing = 0.0f;
+    float m_cellSize = 0.0f;
+    float m_inverseCellSize = 0.0f;
+    glm::vec3 m_lo;
+    int m_dims[3];
+
+    // points of cell (x, y, z) are [m_cellStart[c], m_cellStart[c + 1]), with
+    // c = (z * m_dims[1] + y) * m_dims[0] + x
+    std::vector<unsigned int> m_cellStart;
+    std::vector<glm::vec3> m_points;        // points in cell order
+    std::vector<int> m_indices;             // original index of each point in cell order
+    std::vector<unsigned int> m_slots;      // cell order position of each original point
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include "icp.hpp"
+#include "Kabsch.hpp"
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <Eigen/Dense>
+
+using namespace std;
+
+namespace
+{
+    Eigen::Affine3d toAffine(const glm::mat4 &m)
+    {
+        Eigen::Affine3d a;
+        a.matrix().setIdentity();
+        for (int c = 0; c < 4; c++)
+            for (int r = 0; r < 3; r++)
+                a.matrix()(r, c) = m[c][r];
+        return a;
+    }
+
+    glm::mat4 toMat4(const Eigen::Affine3d &a)
+    {
+        glm::mat4 m(1.0f);
+        for (int c = 0; c < 4; c++)
+            for (int r = 0; r < 3; r++)
+                m[c][r] = (float) a.matrix()(r, c);
+        return m;
+    }
+
+    Eigen::Vector3d toVector(const glm::vec3 &v)
+    {
+        return Eigen::Vector3d(v.x, v.y, v.z);
+    }
+
+    struct Pair
+    {
+        unsigned int source;
+        int target;             // -1 once rejected
+        float distance2;
+    };
+
+    // Best rigid motion for the kept pairs, by Kabsch on their covariance
+    Eigen::Affine3d solvePointToPoint(const vector<Pair> &pairs, const vector<Eigen::Vector3d> &moved,
+                                      const vector<glm::vec3> &target)
+    {
+        Eigen::Vector3d sourceCenter = Eigen::Vector3d::Zero();
+        Eigen::Vector3d targetCenter = Eigen::Vector3d::Zero();
+        unsigned long count = 0;
+        for (unsigned long i = 0; i < pairs.size(); i++)
+        {
+            if (pairs[i].target < 0)
+                continue;
+            sourceCenter += moved[i];
+            targetCenter += toVector(target[pairs[i].target]);
+            count++;
+        }
+        sourceCenter /= count;
+        targetCenter /= count;
+
+        Eigen::Matrix3d cov = Eigen::Matrix3d::Zero();
+        for (unsigned long i = 0; i < pairs.size(); i++)
+            if (pairs[i].target >= 0)
+                cov += (moved[i] - sourceCenter) * (toVector(target[pairs[i].target]) - targetCenter).transpose();
+
+        Eigen::Affine3d update = Eigen::Affine3d::Identity();
+        update.linear() = FindRotationFromCovariance(cov);
+        update.translation() = targetCenter - update.linear() * sourceCenter;
+        return update;
+    }
+
+    // One Gauss-Newton step on the point-to-plane error sum(((R p + t - q) . n)^2),
+    // linearised in the rotation (Low, 2004); the rotation found is then used exactly
+    Eigen::Affine3d solvePointToPlane(const vector<Pair> &pairs, const vector<Eigen::Vector3d> &moved,
+                                      const vector<glm::vec3> &target, const vector<glm::vec3> &targetNormals)
+    {
+        Eigen::Matrix<double, 6, 6> A = Eigen::Matrix<double, 6, 6>::Zero();
+        Eigen::Matrix<double, 6, 1> b = Eigen::Matrix<double, 6, 1>::Zero();
+        for (unsigned long i = 0; i < pairs.size(); i++)
+        {
+            if (pairs[i].target < 0)
+                continue;
+            Eigen::Vector3d n = toVector(targetNormals[pairs[i].target]);
+            Eigen::Matrix<double, 6, 1> J;
+            J << moved[i].cross(n), n;
+            double r = (toVector(target[pairs[i].target]) - moved[i]).dot(n);
+            A.selfadjointView<Eigen::Lower>().rankUpdate(J);
+            b += r * J;
+        }
+        Eigen::Matrix<double, 6, 1> x = A.selfadjointView<Eigen::Lower>().ldlt().solve(b);
+
+        Eigen::Affine3d update = Eigen::Affine3d::Identity();
+        Eigen::Vector3d omega = x.head<3>();
+        if (x.allFinite())
+        {
+            if (omega.norm() > 0)
+                update.linear() = Eigen::AngleAxisd(omega.norm(), omega.normalized()).toRotationMatrix();
+            update.translation() = x.tail<3>();
+        }
+        return update;
+    }
+}
+
+ICPResult icpAlign(const std::vector<glm::vec3> &source, const std::vector<glm::vec3> &sourceNormals,
+                   const glm::mat4 &sourcePose,
+                   const std::vector<glm::vec3> &target, const std::vector<glm::vec3> &targetNormals,
+                   const SpatialIndex &targetIndex, const glm::mat4 &targetPose,
+                   const ICPOptions &options)
+{
+    ICPResult result;
+    result.pose = sourcePose;
+    if (source.empty() || targetIndex.empty())
+        return result;
+
+    bool useNormals = sourceNormals.size() == source.size() && targetNormals.size() == target.size();
+    ICPMetric metric = options.metric;
+    if (targetNormals.size() != target.size())
+        metric = ICP_POINT_TO_POINT;
+    unsigned long minPairs = metric == ICP_POINT_TO_PLANE ? 6 : 3;
+
+    // every stride-th vertex; the fetch-optimised vertex order spreads them evenly
+    unsigned long stride = 1;
+    if (options.maxSamples > 0 && source.size() > options.maxSamples)
+        stride = (source.size() + options.maxSamples - 1) / options.maxSamples;
+    long numSamples = (long) ((source.size() + stride - 1) / stride);
+
+    // the source in target model space; ICP refines this transform
+    Eigen::Affine3d targetInverse = toAffine(targetPose).inverse(Eigen::Isometry);
+    Eigen::Affine3d transform = targetInverse * toAffine(sourcePose);
+
+    vector<Pair> pairs(numSamples);
+    vector<Eigen::Vector3d> moved(numSamples);
+    vector<float> kept;
+    float maxDistance2 = options.maxDistance * options.maxDistance;
+    float minCosine = cosf(options.maxNormalAngle);
+    double previousRMS = -1.0;
+
+    for (result.iterations = 0; result.iterations < options.maxIterations; )
+    {
+        // correspondences
+        long i;
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (i = 0; i < numSamples; i++)
+        {
+            Pair &pair = pairs[i];
+            pair.source = (unsigned int) (i * stride);
+            moved[i] = transform * toVector(source[pair.source]);
+            glm::vec3 query((float) moved[i].x(), (float) moved[i].y(), (float) moved[i].z());
+            pair.target = targetIndex.nearest(query, &pair.distance2);
+            if (maxDistance2 > 0.0f && pair.distance2 > maxDistance2)
+                pair.target = -1;
+            if (useNormals && pair.target >= 0)
+            {
+                Eigen::Vector3d n = transform.linear() * toVector(sourceNormals[pair.source]);
+                if (n.dot(toVector(targetNormals[pair.target])) < minCosine)
+                    pair.target = -1;
+            }
+        }
+
+        // keep the closest fraction of what is left
+        kept.clear();
+        for (i = 0; i < numSamples; i++)
+            if (pairs[i].target >= 0)
+                kept.push_back(pairs[i].distance2);
+        if (options.keepFraction < 1.0f && !kept.empty())
+        {
+            unsigned long k = (unsigned long) (options.keepFraction * (kept.size() - 1));
+            nth_element(kept.begin(), kept.begin() + k, kept.end());
+            float limit = kept[k];
+            unsigned long numKept = 0;
+            for (i = 0; i < numSamples; i++)
+            {
+                if (pairs[i].target < 0)
+                    continue;
+                if (pairs[i].distance2 > limit)
+                    pairs[i].target = -1;
+                else
+                    numKept++;
+            }
+            kept.resize(numKept);
+        }
+        if (kept.size() < minPairs)
+            break;
+
+        double sum = 0.0;
+        for (i = 0; i < numSamples; i++)
+            if (pairs[i].target >= 0)
+                sum += pairs[i].distance2;
+        result.pairs = kept.size();
+        result.rms = sqrt(sum / kept.size());
+
+        // alignment
+        Eigen::Affine3d update = metric == ICP_POINT_TO_PLANE
+            ? solvePointToPlane(pairs, moved, target, targetNormals)
+            : solvePointToPoint(pairs, moved, target);
+        transform = update * transform;
+        result.iterations++;
+
+        double angle = Eigen::AngleAxisd(update.linear()).angle();
+        double shift = update.translation().norm();
+        if ((angle < options.rotationTolerance && shift < options.translationTolerance) ||
+            (previousRMS >= 0.0 && fabs(previousRMS - result.rms) <= options.errorTolerance * previousRMS))
+        {
+            result.converged = true;
+            break;
+        }
+        previousRMS = result.rms;
+    }
+
+    result.pose = toMat4(toAffine(targetPose) * transform);
+    return result;
+}
+
+void computeVertexNormals(const std::vector<glm::vec3> &positions, const std::vector<unsigned int> &indices,
+                          std::vector<glm::vec3> &normals)
+{
+    normals.assign(positions.size(), glm::vec3(0.0f));
+    unsigned long numCorners = indices.empty() ? positions.size() : indices.size();
+    for (unsigned long k = 0; k + 2 < numCorners; k += 3)
+    {
+        unsigned int a = indices.empty() ? k : indices[k];
+        unsigned int b = indices.empty() ? k + 1 : indices[k + 1];
+        unsigned int c = indices.empty() ? k + 2 : indices[k + 2];
+        // the cross product's length is twice the triangle area
+        glm::vec3 n = glm::cross(positions[b] - positions[a], positions[c] - positions[a]);
+        normals[a] += n;
+        normals[b] += n;
+        normals[c] += n;
+    }
+    for (unsigned long i = 0; i < normals.size(); i++)
+        if (glm::dot(normals[i], normals[i]) > 0.0f)
+            normals[i] = glm::normalize(normals[i]);
+}
@@ -0,0 +1,57 @@
+#ifndef ICP_HPP
+#define ICP_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "spatialindex.hpp"
+
+// Iterative closest point registration. Each iteration pairs (a subsample
+// of) the source vertices with their nearest target vertices, rejects bad
+// pairs, and solves for the rigid motion that best aligns the rest: Kabsch
+// for point-to-point, a linearised least squares step for point-to-plane.
+
+enum ICPMetric
+{
+    ICP_POINT_TO_POINT,
+    ICP_POINT_TO_PLANE
+};
+
+struct ICPOptions
+{
+    ICPMetric metric = ICP_POINT_TO_PLANE;
+    unsigned int maxIterations = 50;
+    unsigned int maxSamples = 20000;     // source vertices paired per iteration, 0 = all
+    float maxDistance = 0.0f;            // reject pairs further apart (target units), 0 = no limit
+    float keepFraction = 0.9f;           // then keep only this fraction of the closest pairs
+    float maxNormalAngle = 1.0f;         // reject pairs whose normals differ more (radians)
+    double rotationTolerance = 1e-6;     // converged once an update rotates less (radians)
+    double translationTolerance = 1e-6;  // ... and moves less than this (target units)
+    double errorTolerance = 1e-6;        // or the RMS error changes by less than this fraction
+};
+
+struct ICPResult
+{
+    glm::mat4 pose;             // the new source pose
+    unsigned int iterations = 0;
+    unsigned long pairs = 0;    // pairs used by the last update
+    double rms = 0.0;           // RMS distance of those pairs before the update
+    bool converged = false;
+};
+
+// Rigidly aligns the source mesh, placed in the world by sourcePose, to the
+// target mesh placed by targetPose. targetIndex indexes target. Normals may
+// be empty, which disables the normal test; point-to-plane needs target
+// normals and falls back to point-to-point without them.
+ICPResult icpAlign(const std::vector<glm::vec3> &source, const std::vector<glm::vec3> &sourceNormals,
+                   const glm::mat4 &sourcePose,
+                   const std::vector<glm::vec3> &target, const std::vector<glm::vec3> &targetNormals,
+                   const SpatialIndex &targetIndex, const glm::mat4 &targetPose,
+                   const ICPOptions &options = ICPOptions());
+
+// Area weighted vertex normals of a triangle mesh; indices may be empty for
+// a triangle soup.
+void computeVertexNormals(const std::vector<glm::vec3> &positions, const std::vector<unsigned int> &indices,
+                          std::vector<glm::vec3> &normals);
+
+#endif
@@ -0,0 +1,209 @@
+#include "incrementaltps.hpp"
+#include <Eigen/Dense>
+#include <stdio.h>
+#include <math.h>
+#include <cmath>
+
+namespace
+{
+    // a pivot this small against the diagonal of G means gamma is too small
+    // for G to be positive definite
+    const double PIVOT_TOLERANCE = 1e-10;
+    const double GAMMA_GROWTH = 16.0;
+    // growths of gamma before G is taken to be singular, up to about 1e38
+    const int MAX_GAMMA_STEPS = 32;
+    // control points closer than this, against the landmarks' spread, count
+    // as the same point
+    const double COINCIDENT_TOLERANCE = 1e-6;
+}
+
+bool IncrementalTPS::push(const glm::vec3 &control, const glm::vec3 &target)
+{
+    for (unsigned int i = 0; i < size(); i++)
+    {
+        glm::dvec3 offset = glm::dvec3(control) - glm::dvec3(m_controls[i]);
+        if (glm::length(offset) <= COINCIDENT_TOLERANCE * m_scale)
+            return false;
+    }
+
+    double gamma = m_gamma, scale = m_scale;
+    m_controls.push_back(control);
+    m_targets.push_back(target);
+    // the second landmark sets the scale
+    if (size() != 2 && factorRow(size() - 1))
+        return true;
+    if (refactor())
+        return true;
+
+    // nearly coincident with another: put the factor back as it was
+    m_controls.pop_back();
+    m_targets.pop_back();
+    m_gamma = gamma;
+    m_scale = scale;
+    refactor();
+    return false;
+}
+
+void IncrementalTPS::pop()
+{
+    if (m_controls.empty())
+        return;
+    m_controls.pop_back();
+    m_targets.pop_back();
+    m_factor.resize(m_controls.size() * (m_controls.size() + 1) / 2);
+}
+
+void IncrementalTPS::clear()
+{
+    m_controls.clear();
+    m_targets.clear();
+    m_factor.clear();
+}
+
+glm::dvec3 IncrementalTPS::normalized(unsigned int i) const
+{
+    return (glm::dvec3(m_controls[i]) - glm::dvec3(m_controls[0])) * (1.0 / m_scale);
+}
+
+// G(i, j) = U(|n_i - n_j|) + gamma P_i P_j', with P_i = (1, n_i) for the
+// normalized landmarks n_i
+double IncrementalTPS::gram(unsigned int i, unsigned int j) const
+{
+    glm::dvec3 ni = normalized(i), nj = normalized(j);
+    return TPSWarp::baseFunction(glm::length(ni - nj)) + m_gamma * (1.0 + glm::dot(ni, nj));
+}
+
+// Appends row i of the factor, L_i = L^-1 G_i, by forward substitution
+bool IncrementalTPS::factorRow(unsigned int i)
+{
+    m_factor.resize((size_t) i * (i + 1) / 2);
+    double sum2 = 0.0;
+    for (unsigned int j = 0; j < i; j++)
+    {
+        const double *row = &m_factor[(size_t) j * (j + 1) / 2];
+        const double *current = &m_factor[(size_t) i * (i + 1) / 2];
+        double value = gram(i, j);
+        for (unsigned int k = 0; k < j; k++)
+            value -= row[k] * current[k];
+        value /= row[j];
+        m_factor.push_back(value);
+        sum2 += value * value;
+    }
+    double diagonal = gram(i, i);
+    double pivot = diagonal - sum2;
+    if (!(pivot > PIVOT_TOLERANCE * diagonal))
+        return false;
+    m_factor.push_back(sqrt(pivot));
+    return true;
+}
+
+// Factors G from scratch at the landmarks' current spread, raising gamma
+// until G is positive definite; false if it stays singular
+bool IncrementalTPS::refactor()
+{
+    double spread2 = 0.0;
+    for (unsigned int i = 1; i < size(); i++)
+    {
+        glm::dvec3 offset = glm::dvec3(m_controls[i]) - glm::dvec3(m_controls[0]);
+        spread2 += glm::dot(offset, offset);
+    }
+    if (spread2 > 0.0)
+        m_scale = sqrt(spread2 / (size() - 1));
+
+    double gamma = m_gamma;
+    for (int step = 0; ; step++)
+    {
+        unsigned int i = 0;
+        while (i < size() && factorRow(i))
+            i++;
+        if (i == size())
+            break;
+        m_gamma *= GAMMA_GROWTH;
+        if (step == MAX_GAMMA_STEPS || !std::isfinite(m_gamma))
+        {
+            m_gamma = gamma;
+            return false;
+        }
+    }
+    if (m_gamma != gamma)
+        fprintf(stderr, "Refactored the TPS over %u landmarks with gamma %g\n", size(), m_gamma);
+    return true;
+}
+
+// Solves G x = b in place: down L, then back up L' a column at a time
+void IncrementalTPS::solveFactored(double *x) const
+{
+    unsigned int n = size();
+    for (unsigned int i = 0; i < n; i++)
+    {
+        const double *row = &m_factor[(size_t) i * (i + 1) / 2];
+        double value = x[i];
+        for (unsigned int k = 0; k < i; k++)
+            value -= row[k] * x[k];
+        x[i] = value / row[i];
+    }
+    for (unsigned int i = n; i-- > 0; )
+    {
+        const double *row = &m_factor[(size_t) i * (i + 1) / 2];
+        x[i] /= row[i];
+        for (unsigned int k = 0; k < i; k++)
+            x[k] -= row[k] * x[i];
+    }
+}
+
+// Fits the displacements, so a missing affine part is the identity. With P
+// centred on the normalized landmarks, c solves (P' G^-1 P) c = P' G^-1 D,
+// in least norm when P is rank deficient, and w = G^-1 (D - P c)
+bool IncrementalTPS::solve(TPSWarp &warp) const
+{
+    unsigned int n = size();
+    if (n == 0)
+        return false;
+
+    glm::dvec3 center(0.0);
+    for (unsigned int i = 0; i < n; i++)
+        center += normalized(i);
+    center /= (double) n;
+
+    Eigen::MatrixXd p(n, 4), d(n, 3);
+    for (unsigned int i = 0; i < n; i++)
+    {
+        glm::dvec3 c = normalized(i) - center;
+        glm::dvec3 move = (glm::dvec3(m_targets[i]) - glm::dvec3(m_controls[i])) * (1.0 / m_scale);
+        p.row(i) << 1.0, c.x, c.y, c.z;
+        d.row(i) << move.x, move.y, move.z;
+    }
+    Eigen::MatrixXd gp = p, gd = d;
+    for (int k = 0; k < 4; k++)
+        solveFactored(gp.col(k).data());
+    for (int k = 0; k < 3; k++)
+        solveFactored(gd.col(k).data());
+    Eigen::Matrix4d s = p.transpose() * gp;
+    Eigen::MatrixXd affine = s.completeOrthogonalDecomposition().solve(p.transpose() * gd);
+    Eigen::MatrixXd w = gd - gp * affine;
+
+    // Back to TPSWarp's (p+4) x 3 layout in the original units, where
+    // f(x) = x + scale f'((x - c_0) / scale). U(r / scale) is
+    // (U(r) - r^2 log scale) / scale^2, and as sum w = 0 and sum w c = 0,
+    // sum w r^2 is the constant sum w |c - c_0|^2.
+    std::vector<double> centers(3 * n), weights(3 * (n + 4));
+    glm::dvec3 origin = glm::dvec3(m_controls[0]);
+    glm::dvec3 mean = origin + center * m_scale;
+    double logScale = log(m_scale);
+    for (int k = 0; k < 3; k++)
+    {
+        double constant = m_scale * affine(0, k) - mean.x * affine(1, k) - mean.y * affine(2, k) - mean.z * affine(3, k);
+        for (unsigned int i = 0; i < n; i++)
+        {
+            glm::dvec3 offset = glm::dvec3(m_controls[i]) - origin;
+            centers[3 * i + k] = m_controls[i][k];
+            weights[3 * i + k] = w(i, k) / m_scale;
+            constant -= logScale / m_scale * w(i, k) * glm::dot(offset, offset);
+        }
+        weights[3 * n + k] = constant;
+        for (int a = 0; a < 3; a++)
+            weights[3 * (n + 1 + a) + k] = affine(1 + a, k) + (a == k ? 1.0 : 0.0);
+    }
+    warp.set(centers.data(), n, weights.data());
+    return true;
+}
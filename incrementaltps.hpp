@@ -0,0 +1,60 @@
+#ifndef INCREMENTALTPS_HPP
+#define INCREMENTALTPS_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "tpswarp.hpp"
+
+// 3D thin plate spline through landmarks that come and go one at a time, as
+// markers are placed and undone. The kernel weights w and the affine part c
+// solve K w + P c = V with P'w = 0, and since P'w = 0, K can be replaced by
+// G = K + gamma P P' without changing the answer. K is conditionally
+// positive definite, so G is positive definite for a large enough gamma and
+// has a Cholesky factor, which gains a row in O(p^2) when a landmark is
+// added and drops its last row when the last one is removed. Solving for
+// the weights is then O(p^2) rather than O(p^3). G is built from the
+// landmarks taken relative to the first and scaled by their spread, which
+// keeps it equally well conditioned at any scale; the spline is the same up
+// to an affine term, which the weights handed to TPSWarp absorb.
+//
+// With fewer than four landmarks, or coplanar ones, the affine part is the
+// smallest that fits, so one landmark translates and two stretch along the
+// line between them.
+class IncrementalTPS
+{
+public:
+    IncrementalTPS() {}
+    ~IncrementalTPS() {}
+
+    // false, leaving the fit as it was, if the control point coincides with
+    // one already there, which no gamma can make G positive definite for
+    bool push(const glm::vec3 &control, const glm::vec3 &target);
+    void pop();
+    void clear();
+    // only the control points are factored, so targets move for free
+    void setTarget(unsigned int i, const glm::vec3 &target) { m_targets[i] = target; }
+    unsigned int size() const { return (unsigned int) m_controls.size(); }
+    const glm::vec3 &control(unsigned int i) const { return m_controls[i]; }
+    const glm::vec3 &target(unsigned int i) const { return m_targets[i]; }
+
+    // sets warp to take each control point onto its target; false without
+    // landmarks
+    bool solve(TPSWarp &warp) const;
+
+private:
+    glm::dvec3 normalized(unsigned int i) const;
+    double gram(unsigned int i, unsigned int j) const;
+    bool factorRow(unsigned int i);
+    bool refactor();
+    void solveFactored(double *x) const;
+
+    std::vector<glm::vec3> m_controls;
+    std::vector<glm::vec3> m_targets;
+    // lower triangle of the Cholesky factor of G by rows, row i from i(i+1)/2
+    std::vector<double> m_factor;
+    double m_gamma = 1.0;
+    double m_scale = 1.0;       // landmarks are factored as (c - c_0) / m_scale
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include "indexfile.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace
+{
+    const uint32_t VERSION = 1;
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t numArrays;
+        uint64_t key;
+        uint64_t size[IndexFile::MAX_ARRAYS];      // bytes
+        uint64_t offset[IndexFile::MAX_ARRAYS];    // bytes from the start of the file
+    };
+
+    const size_t ALIGNMENT = 16;
+
+    size_t align(size_t offset)
+    {
+        return (offset + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+}
+
+bool IndexFile::write(const char *path, const char magic[8], uint64_t key, unsigned int numArrays,
+                      const void *const *arrays, const size_t *sizes)
+{
+    if (numArrays > MAX_ARRAYS)
+        return false;
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = VERSION;
+    header.numArrays = numArrays;
+    header.key = key;
+    size_t offset = align(sizeof(Header));
+    for (unsigned int a = 0; a < numArrays; a++)
+    {
+        header.size[a] = sizes[a];
+        header.offset[a] = offset;
+        offset = align(offset + sizes[a]);
+    }
+
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int) getpid());
+    FILE *out = fopen(tmpPath, "wb");
+    if (!out)
+        return false;
+    static const char zeros[ALIGNMENT] = { 0 };
+    size_t pad = align(sizeof(Header)) - sizeof(Header);
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(zeros, 1, pad, out) == pad;
+    for (unsigned int a = 0; a < numArrays && ok; a++)
+    {
+        if (sizes[a])
+            ok = fwrite(arrays[a], 1, sizes[a], out) == sizes[a];
+        pad = align(sizes[a]) - sizes[a];
+        ok = ok && fwrite(zeros, 1, pad, out) == pad;
+    }
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmpPath, path) != 0)
+    {
+        unlink(tmpPath);
+        return false;
+    }
+    return true;
+}
+
+bool IndexFile::open(const char *path, const char magic[8], uint64_t key, unsigned int numArrays)
+{
+    if (!m_file.open(path))
+        return false;
+
+    const Header *header = (const Header *) m_file.data();
+    bool ok = m_file.size() >= sizeof(Header) &&
+              memcmp(header->magic, magic, sizeof(header->magic)) == 0 &&
+              header->version == VERSION &&
+              header->numArrays == numArrays &&
+              numArrays <= MAX_ARRAYS &&
+              header->key == key;
+    for (unsigned int a = 0; a < numArrays && ok; a++)
+        ok = header->offset[a] % ALIGNMENT == 0 && header->offset[a] + header->size[a] <= m_file.size();
+    if (!ok)
+        m_file.close();
+    return ok;
+}
+
+const void *IndexFile::array(unsigned int a) const
+{
+    return m_file.data() + ((const Header *) m_file.data())->offset[a];
+}
+
+size_t IndexFile::size(unsigned int a) const
+{
+    return (size_t) ((const Header *) m_file.data())->size[a];
+}
@@ -0,0 +1,43 @@
+#ifndef INDEXFILE_HPP
+#define INDEXFILE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include "objparser.hpp"
+
+// Flat file holding the arrays of a built search structure behind a small
+// header, to be memory mapped and queried in place instead of rebuilding
+// the structure. The header records a key, normally a hash of the data the
+// structure was built from, and open() rejects files written for another.
+// The arrays must be plain data; the mapping is read only, so processes
+// mapping the same file share one copy of it in the page cache.
+class IndexFile
+{
+public:
+    static const unsigned int MAX_ARRAYS = 8;
+
+    IndexFile() {}
+    ~IndexFile() {}
+
+    // Writes numArrays arrays of sizes[a] bytes each to path. The file is
+    // written under a temporary name and renamed into place, so readers see
+    // either the whole file or none.
+    static bool write(const char *path, const char magic[8], uint64_t key, unsigned int numArrays,
+                      const void *const *arrays, const size_t *sizes);
+
+    // Maps path if it holds numArrays arrays written with magic and key
+    bool open(const char *path, const char magic[8], uint64_t key, unsigned int numArrays);
+    void close() { m_file.close(); }
+    bool isOpen() const { return m_file.isOpen(); }
+
+    const void *array(unsigned int a) const;
+    size_t size(unsigned int a) const;     // in bytes
+
+private:
+    IndexFile(const IndexFile &);
+    IndexFile &operator=(const IndexFile &);
+
+    MappedFile m_file;
+};
+
+#endif
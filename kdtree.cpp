@@ -0,0 +1,210 @@
+#include "kdtree.hpp"
+#include <algorithm>
+#include <cfloat>
+
+using namespace std;
+
+namespace
+{
+    const char MAGIC[8] = { 'K', 'D', 'T', 'R', 'E', 'E', '0', '1' };
+
+    enum { NODES, POINTS, INDICES, SLOTS, NUM_ARRAYS };
+
+    struct AxisLess
+    {
+        AxisLess(const std::vector<glm::vec3> &points, unsigned int axis) : m_points(points), m_axis(axis) {}
+        bool operator()(unsigned int a, unsigned int b) const { return m_points[a][m_axis] < m_points[b][m_axis]; }
+        const std::vector<glm::vec3> &m_points;
+        unsigned int m_axis;
+    };
+}
+
+void KDTree::build(const std::vector<glm::vec3> &points)
+{
+    m_file.close();
+    m_nodes.clear();
+    m_points.clear();
+    m_indices.clear();
+    m_slots.clear();
+    useVectors();
+    if (points.empty())
+        return;
+
+    std::vector<unsigned int> order(points.size());
+    for (unsigned int i = 0; i < order.size(); i++)
+        order[i] = i;
+
+    m_nodes.reserve(2 * (points.size() / LEAF_SIZE + 1));
+    buildNode(0, (unsigned int) points.size(), order, points);
+
+    m_points.resize(points.size());
+    m_indices.resize(points.size());
+    m_slots.resize(points.size());
+    for (unsigned int i = 0; i < order.size(); i++)
+    {
+        m_points[i] = points[order[i]];
+        m_indices[i] = order[i];
+        m_slots[order[i]] = i;
+    }
+    useVectors();
+}
+
+void KDTree::useVectors()
+{
+    m_nodeData = m_nodes.data();
+    m_pointData = m_points.data();
+    m_indexData = m_indices.data();
+    m_slotData = m_slots.data();
+    m_numNodes = m_nodes.size();
+    m_numPoints = m_points.size();
+}
+
+bool KDTree::save(const char *path, uint64_t key) const
+{
+    const void *arrays[NUM_ARRAYS] = { m_nodeData, m_pointData, m_indexData, m_slotData };
+    size_t sizes[NUM_ARRAYS] = { m_numNodes * sizeof(Node), m_numPoints * sizeof(glm::vec3),
+                                 m_numPoints * sizeof(int), m_numPoints * sizeof(unsigned int) };
+    return IndexFile::write(path, MAGIC, key, NUM_ARRAYS, arrays, sizes);
+}
+
+// Maps a saved tree in place of the current one; on failure the tree is empty
+bool KDTree::load(const char *path, uint64_t key)
+{
+    build(std::vector<glm::vec3>());
+    if (!m_file.open(path, MAGIC, key, NUM_ARRAYS))
+        return false;
+    unsigned long numNodes = m_file.size(NODES) / sizeof(Node);
+    unsigned long numPoints = m_file.size(POINTS) / sizeof(glm::vec3);
+    if (numNodes == 0 ||
+        m_file.size(NODES) != numNodes * sizeof(Node) ||
+        m_file.size(POINTS) != numPoints * sizeof(glm::vec3) ||
+        m_file.size(INDICES) != numPoints * sizeof(int) ||
+        m_file.size(SLOTS) != numPoints * sizeof(unsigned int))
+    {
+        m_file.close();
+        return false;
+    }
+
+    m_nodeData = (const Node *) m_file.array(NODES);
+    m_pointData = (const glm::vec3 *) m_file.array(POINTS);
+    m_indexData = (const int *) m_file.array(INDICES);
+    m_slotData = (const unsigned int *) m_file.array(SLOTS);
+    m_numNodes = numNodes;
+    m_numPoints = numPoints;
+    return true;
+}
+
+unsigned int KDTree::buildNode(unsigned int begin, unsigned int end, std::vector<unsigned int> &order,
+                               const std::vector<glm::vec3> &points)
+{
+    unsigned int nodeIndex = (unsigned int) m_nodes.size();
+    m_nodes.push_back(Node());
+
+    if (end - begin <= LEAF_SIZE)
+    {
+        m_nodes[nodeIndex].split = 0.0f;
+        m_nodes[nodeIndex].axis = LEAF;
+        m_nodes[nodeIndex].begin = begin;
+        m_nodes[nodeIndex].end = end;
+        return nodeIndex;
+    }
+
+    // split along the widest axis of the bounding box
+    glm::vec3 lo = points[order[begin]], hi = lo;
+    for (unsigned int i = begin + 1; i < end; i++)
+    {
+        lo = glm::min(lo, points[order[i]]);
+        hi = glm::max(hi, points[order[i]]);
+    }
+    glm::vec3 extent = hi - lo;
+    unsigned int axis = 0;
+    if (extent[1] > extent[axis])
+        axis = 1;
+    if (extent[2] > extent[axis])
+        axis = 2;
+
+    // everything left of mid is <= split, everything from mid on is >= split
+    unsigned int mid = begin + (end - begin) / 2;
+    nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, AxisLess(points, axis));
+
+    m_nodes[nodeIndex].split = points[order[mid]][axis];
+    m_nodes[nodeIndex].axis = axis;
+    m_nodes[nodeIndex].begin = begin;
+    buildNode(begin, mid, order, points);
+    unsigned int right = buildNode(mid, end, order, points);
+    m_nodes[nodeIndex].end = right;
+    return nodeIndex;
+}
+
+int KDTree::nearest(const glm::vec3 &query, float *distance2) const
+{
+    return nearestFrom(query, -1, 0.0f, distance2);
+}
+
+int KDTree::nearestFrom(const glm::vec3 &query, int hint, float epsilon, float *distance2) const
+{
+    if (m_numNodes == 0)
+        return -1;
+
+    float bestScore = FLT_MAX;
+    int bestIndex = -1;
+    glm::vec3 diff;
+    if (hint >= 0 && hint < (int) m_numPoints)
+    {
+        diff = m_pointData[m_slotData[hint]] - query;
+        bestScore = glm::dot(diff, diff);
+        bestIndex = hint;
+    }
+    // cells are compared against the best distance shrunk by (1 + epsilon)^2;
+    // exactly 1 for an exact search
+    float shrink = 1.0f / ((1.0f + epsilon) * (1.0f + epsilon));
+
+    // (node, squared distance from query to the node's splitting plane)
+    unsigned int stackNode[64];
+    float stackBound[64];
+    int top = 0;
+    stackNode[top] = 0;
+    stackBound[top] = 0.0f;
+    top++;
+
+    while (top > 0)
+    {
+        top--;
+        // '<=' rather than '<' so that equidistant points with a lower index are still found
+        if (stackBound[top] > bestScore * shrink)
+            continue;
+        unsigned int n = stackNode[top];
+
+        while (m_nodeData[n].axis != LEAF)
+        {
+            const Node &node = m_nodeData[n];
+            float d = query[node.axis] - node.split;
+            unsigned int nearChild = d < 0.0f ? n + 1 : node.end;
+            unsigned int farChild = d < 0.0f ? node.end : n + 1;
+            // the far side is only worth a look if the plane is within the current best
+            if (d * d <= bestScore * shrink)
+            {
+                stackNode[top] = farChild;
+                stackBound[top] = d * d;
+                top++;
+            }
+            n = nearChild;
+        }
+
+        const Node &leaf = m_nodeData[n];
+        for (unsigned int i = leaf.begin; i < leaf.end; i++)
+        {
+            diff = m_pointData[i] - query;
+            float score = glm::dot(diff, diff);
+            if (score < bestScore || (score == bestScore && m_indexData[i] < bestIndex))
+            {
+                bestScore = score;
+                bestIndex = m_indexData[i];
+            }
+        }
+    }
+
+    if (distance2)
+        *distance2 = bestScore;
+    return bestIndex;
+}
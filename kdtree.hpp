@@ -0,0 +1,70 @@
+#ifndef KDTREE_HPP
+#define KDTREE_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "spatialindex.hpp"
+#include "indexfile.hpp"
+
+// Static k-d tree over a set of points, used for nearest neighbour queries.
+// Nodes and points are stored in flat arrays (no pointers), so a tree is
+// built once per point set and queried from any number of threads, and can
+// be saved to a file and mapped back as it is.
+class KDTree : public SpatialIndex
+{
+public:
+    KDTree() {}
+    KDTree(const std::vector<glm::vec3> &points) { build(points); }
+    ~KDTree() {}
+
+    void build(const std::vector<glm::vec3> &points);
+
+    // Returns the index (into the original point set) of the point closest
+    // to query, or -1 if the tree is empty. Ties go to the lowest index, so
+    // the result matches a linear scan with a strict '<' comparison.
+    int nearest(const glm::vec3 &query, float *distance2 = (float*) 0) const;
+    // starts with the hint's distance as the search radius, and skips cells
+    // that could only improve on the best by less than a factor 1 + epsilon
+    int nearestFrom(const glm::vec3 &query, int hint, float epsilon = 0.0f, float *distance2 = (float*) 0) const;
+
+    unsigned long size() const { return m_numPoints; }
+
+    bool save(const char *path, uint64_t key) const;
+    bool load(const char *path, uint64_t key);
+
+private:
+    KDTree(const KDTree &);
+    KDTree &operator=(const KDTree &);
+
+    static const unsigned int LEAF_SIZE = 8;
+    static const unsigned int LEAF = 3;
+
+    struct Node
+    {
+        float split;
+        unsigned int axis;     // 0, 1, 2 or LEAF
+        unsigned int begin;    // leaf: range into m_points
+        unsigned int end;      // inner: index of right child (left is this + 1)
+    };
+
+    unsigned int buildNode(unsigned int begin, unsigned int end, std::vector<unsigned int> &order,
+                           const std::vector<glm::vec3> &points);
+    void useVectors();
+
+    std::vector<Node> m_nodes;
+    std::vector<glm::vec3> m_points;   // points in tree order
+    std::vector<int> m_indices;        // original index of each point in tree order
+    std::vector<unsigned int> m_slots; // tree order position of each original point
+
+    // what queries read: the vectors above, or the same arrays in m_file
+    IndexFile m_file;
+    const Node *m_nodeData = 0;
+    const glm::vec3 *m_pointData = 0;
+    const int *m_indexData = 0;
+    const unsigned int *m_slotData = 0;
+    unsigned long m_numNodes = 0;
+    unsigned long m_numPoints = 0;
+};
+
+#endif
@@ -10,6 +10,7 @@
 #include "common/shader.hpp"
 #include "globals.hpp"
 #include "model.hpp"
+#include <string.h>
 
 using namespace glm;
 
@@ -80,9 +81,28 @@ int main(int argc, const char *argv[])
     Camera camera(window, vec3(0,0,2), 0.0f, 0.0f);
     Scene scene(&camera, program);
     
+    // options before the models
+    while (argc > 1 && argv[1][0] == '-')
+    {
+        if (argc > 2 && strcmp(argv[1], "--epsilon") == 0)
+        {
+            Model::setProjectionEpsilon((float) atof(argv[2]));
+            argc--;
+            argv++;
+        }
+        else if (strcmp(argv[1], "--check") == 0)
+            Model::setCheckProjection(true);
+        else if (strcmp(argv[1], "--morton") == 0)
+            Model::setMortonOrder(true);
+        else
+            break;
+        argc--;
+        argv++;
+    }
+
     if (argc < 3)
     {
-        fprintf(stderr, "Usage: ./test X.obj X.jpg [Y.obj] [Y.jpg]\n");
+        fprintf(stderr, "Usage: ./test [--epsilon E] [--check] [--morton] X.obj X.jpg [Y.obj] [Y.jpg]\n");
         return -1;
     }
     scene.addModel(argv[1], glm::vec3(0.0f, 0.0f, 0.0f), argv[2]);
@@ -0,0 +1,232 @@
+#include "meshcache.hpp"
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+
+using namespace std;
+
+namespace
+{
+    const char MAGIC[8] = { 'M', 'E', 'S', 'H', 'C', 'A', 'C', 'H' };
+    const uint32_t VERSION = 1;
+
+    enum { POSITIONS, COLORS, TEXCOORDS, NORMALS, CORNERS, NUM_ARRAYS };
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t vertexColors;
+        uint64_t sourceSize;
+        int64_t sourceMtime;
+        uint64_t sourceHash;
+        uint64_t count[NUM_ARRAYS];     // floats, or index tuples for CORNERS
+        uint64_t offset[NUM_ARRAYS];    // bytes from the start of the file
+        char unsupported;
+        char padding[7];
+    };
+
+    const size_t ALIGNMENT = 16;
+
+    size_t align(size_t offset)
+    {
+        return (offset + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    // modification time in nanoseconds; whole seconds would miss edits made
+    // right after the cache was written
+    int64_t modificationTime(const struct stat &st)
+    {
+#ifdef __APPLE__
+        return (int64_t) st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    }
+
+    // rewrites the source mtime in a cache's header in place; the rest of
+    // the file, and any mapping of it, is left as it is
+    void updateMtime(const char *cachePath, int64_t mtime)
+    {
+        FILE *out = fopen(cachePath, "r+b");
+        if (!out)
+            return;
+        if (fseek(out, (long) offsetof(Header, sourceMtime), SEEK_SET) != 0 ||
+            fwrite(&mtime, sizeof(mtime), 1, out) != 1)
+            fprintf(stderr, "Warning: could not update mesh cache %s\n", cachePath);
+        fclose(out);
+    }
+}
+
+// 64-bit FNV-1a
+uint64_t MeshCache::hash(const char *data, size_t size)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        h ^= (unsigned char) data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool MeshCache::load(const char *objPath, bool vertexColors, int numThreads)
+{
+    m_file.close();
+    m_data = ObjData();
+    m_fromCache = false;
+
+    string cachePath = string(objPath) + (vertexColors ? ".color.meshcache" : ".meshcache");
+    if (mapCache(cachePath.c_str(), objPath, vertexColors))
+    {
+        m_fromCache = true;
+        return true;
+    }
+
+    MappedFile source(objPath);
+    if (!source.isOpen())
+        return false;
+    struct stat st;
+    if (stat(objPath, &st) != 0)
+        return false;
+
+    objParse(source.begin(), source.end(), m_data, vertexColors, numThreads);
+    useData();
+
+    // write the new cache next to the OBJ; rename() makes it appear atomically
+    // to any other process loading the same file
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.vertexColors = vertexColors;
+    header.sourceSize = (uint64_t) st.st_size;
+    header.sourceMtime = modificationTime(st);
+    // on coarse-timestamp file systems an edit in the same tick would keep the
+    // mtime, so a source this fresh is always re-hashed on the next load
+    if (time(0) - st.st_mtime < 2)
+        header.sourceMtime = 0;
+    header.sourceHash = hash(source.data(), source.size());
+    header.unsupported = m_data.unsupported;
+
+    const void *arrays[NUM_ARRAYS] = { m_data.positions.data(), m_data.colors.data(), m_data.texcoords.data(),
+                                       m_data.normals.data(), m_data.corners.data() };
+    size_t sizes[NUM_ARRAYS] = { m_data.positions.size() * sizeof(float), m_data.colors.size() * sizeof(float),
+                                 m_data.texcoords.size() * sizeof(float), m_data.normals.size() * sizeof(float),
+                                 m_data.corners.size() * sizeof(ObjIndexTuple) };
+    header.count[POSITIONS] = m_data.positions.size();
+    header.count[COLORS] = m_data.colors.size();
+    header.count[TEXCOORDS] = m_data.texcoords.size();
+    header.count[NORMALS] = m_data.normals.size();
+    header.count[CORNERS] = m_data.corners.size();
+    size_t offset = align(sizeof(Header));
+    for (int a = 0; a < NUM_ARRAYS; a++)
+    {
+        header.offset[a] = offset;
+        offset = align(offset + sizes[a]);
+    }
+
+    char tmpPath[4096];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", cachePath.c_str(), (int) getpid());
+    FILE *out = fopen(tmpPath, "wb");
+    if (!out)
+    {
+        fprintf(stderr, "Warning: could not write mesh cache %s\n", cachePath.c_str());
+        return true;
+    }
+    static const char zeros[ALIGNMENT] = { 0 };
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(zeros, 1, align(sizeof(Header)) - sizeof(Header), out) == align(sizeof(Header)) - sizeof(Header);
+    for (int a = 0; a < NUM_ARRAYS && ok; a++)
+    {
+        if (sizes[a])
+            ok = fwrite(arrays[a], 1, sizes[a], out) == sizes[a];
+        size_t pad = align(sizes[a]) - sizes[a];
+        ok = ok && fwrite(zeros, 1, pad, out) == pad;
+    }
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || rename(tmpPath, cachePath.c_str()) != 0)
+    {
+        fprintf(stderr, "Warning: could not write mesh cache %s\n", cachePath.c_str());
+        unlink(tmpPath);
+    }
+    return true;
+}
+
+// Maps an existing cache and checks it against the current OBJ file
+bool MeshCache::mapCache(const char *cachePath, const char *objPath, bool vertexColors)
+{
+    struct stat st;
+    if (stat(objPath, &st) != 0)
+        return false;
+    if (!m_file.open(cachePath))
+        return false;
+
+    const Header *header = (const Header *) m_file.data();
+    if (m_file.size() < sizeof(Header) ||
+        memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        header->version != VERSION ||
+        header->vertexColors != (uint32_t) vertexColors ||
+        header->sourceSize != (uint64_t) st.st_size)
+    {
+        m_file.close();
+        return false;
+    }
+
+    // a touched but unchanged source is still accepted, at the cost of one
+    // hash, and its new mtime recorded so later loads skip the hash, unless
+    // it is too fresh to trust, as when the cache is written
+    if (header->sourceMtime != modificationTime(st))
+    {
+        MappedFile source(objPath);
+        if (!source.isOpen() || hash(source.data(), source.size()) != header->sourceHash)
+        {
+            m_file.close();
+            return false;
+        }
+        if (time(0) - st.st_mtime >= 2)
+            updateMtime(cachePath, modificationTime(st));
+    }
+
+    size_t elementSize[NUM_ARRAYS] = { sizeof(float), sizeof(float), sizeof(float), sizeof(float), sizeof(ObjIndexTuple) };
+    for (int a = 0; a < NUM_ARRAYS; a++)
+    {
+        if (header->offset[a] % ALIGNMENT != 0 ||
+            header->offset[a] + header->count[a] * elementSize[a] > m_file.size())
+        {
+            m_file.close();
+            return false;
+        }
+    }
+
+    const char *base = m_file.data();
+    m_numPositions = header->count[POSITIONS] / 3;
+    m_numTexcoords = header->count[TEXCOORDS] / 2;
+    m_numNormals = header->count[NORMALS] / 3;
+    m_numCorners = header->count[CORNERS];
+    m_positions = (const float *) (base + header->offset[POSITIONS]);
+    m_colors = header->count[COLORS] ? (const float *) (base + header->offset[COLORS]) : 0;
+    m_texcoords = (const float *) (base + header->offset[TEXCOORDS]);
+    m_normals = (const float *) (base + header->offset[NORMALS]);
+    m_corners = (const ObjIndexTuple *) (base + header->offset[CORNERS]);
+    m_unsupported = header->unsupported;
+    return true;
+}
+
+void MeshCache::useData()
+{
+    m_numPositions = m_data.positions.size() / 3;
+    m_numTexcoords = m_data.texcoords.size() / 2;
+    m_numNormals = m_data.normals.size() / 3;
+    m_numCorners = m_data.corners.size();
+    m_positions = m_data.positions.data();
+    m_colors = m_data.colors.empty() ? 0 : m_data.colors.data();
+    m_texcoords = m_data.texcoords.data();
+    m_normals = m_data.normals.data();
+    m_corners = m_data.corners.data();
+    m_unsupported = m_data.unsupported;
+}
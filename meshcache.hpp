@@ -0,0 +1,63 @@
+#ifndef MESHCACHE_HPP
+#define MESHCACHE_HPP
+
+#include <stdint.h>
+#include "objparser.hpp"
+
+// Binary sidecar cache of a parsed OBJ file, stored next to it as
+// "<file>.meshcache", or "<file>.color.meshcache" when parsed with vertex
+// colors, so loading the file both ways keeps both caches. The cache holds
+// the ObjData arrays behind a small header recording the size, mtime and
+// hash of the source text, and is memory mapped on later loads so the
+// arrays are read in place.
+class MeshCache
+{
+public:
+    MeshCache() {}
+    ~MeshCache() {}
+
+    // Maps the cache of objPath, (re)building it from the OBJ text first if
+    // it is missing or stale. Returns false if the OBJ cannot be read.
+    bool load(const char *objPath, bool vertexColors = false, int numThreads = 0);
+
+    // true if the data came from an existing, up to date cache
+    bool fromCache() const { return m_fromCache; }
+
+    size_t numPositions() const { return m_numPositions; }
+    size_t numTexcoords() const { return m_numTexcoords; }
+    size_t numNormals() const { return m_numNormals; }
+    size_t numCorners() const { return m_numCorners; }
+
+    const float *positions() const { return m_positions; }   // 3 per vertex
+    const float *colors() const { return m_colors; }         // 3 per vertex, or null
+    const float *texcoords() const { return m_texcoords; }   // 2 per texture coordinate
+    const float *normals() const { return m_normals; }       // 3 per normal
+    const ObjIndexTuple *corners() const { return m_corners; }
+    char unsupported() const { return m_unsupported; }
+
+    static uint64_t hash(const char *data, size_t size);
+
+private:
+    MeshCache(const MeshCache &);
+    MeshCache &operator=(const MeshCache &);
+
+    bool mapCache(const char *cachePath, const char *objPath, bool vertexColors);
+    void useData();
+
+    MappedFile m_file;
+    ObjData m_data;     // used directly when the cache cannot be written
+    bool m_fromCache = false;
+
+    size_t m_numPositions = 0;
+    size_t m_numTexcoords = 0;
+    size_t m_numNormals = 0;
+    size_t m_numCorners = 0;
+    const float *m_positions = 0;
+    const float *m_colors = 0;
+    const float *m_texcoords = 0;
+    const float *m_normals = 0;
+    const ObjIndexTuple *m_corners = 0;
+    char m_unsupported = 0;
+};
+
+#endif
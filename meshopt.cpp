@@ -0,0 +1,182 @@
+#include "meshopt.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <cfloat>
+
+using namespace std;
+
+namespace
+{
+    // spreads the low 21 bits of x out to every third bit
+    uint64_t spreadBits(uint64_t x)
+    {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8) & 0x100f00f00f00f00full;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2) & 0x1249249249249249ull;
+        return x;
+    }
+}
+
+float meshACMR(const std::vector<unsigned int> &indices, unsigned int numVertices, unsigned int cacheSize)
+{
+    if (indices.size() < 3)
+        return 0.0f;
+
+    // FIFO cache: a vertex is resident while it was last loaded fewer than
+    // cacheSize misses ago
+    std::vector<unsigned long> loadedAt(numVertices, 0);
+    unsigned long misses = 0;
+    for (unsigned long i = 0; i < indices.size(); i++)
+    {
+        unsigned int v = indices[i];
+        if (loadedAt[v] == 0 || misses + 1 - loadedAt[v] >= cacheSize)
+        {
+            misses++;
+            loadedAt[v] = misses;
+        }
+    }
+    return (float) misses / (float) (indices.size() / 3);
+}
+
+void optimizeVertexCache(std::vector<unsigned int> &indices, unsigned int numVertices, unsigned int cacheSize)
+{
+    unsigned long numTriangles = indices.size() / 3;
+    if (numTriangles == 0)
+        return;
+
+    // vertex -> triangle adjacency, and the number of unemitted triangles per vertex
+    std::vector<unsigned int> live(numVertices, 0);
+    for (unsigned long i = 0; i < numTriangles * 3; i++)
+        live[indices[i]]++;
+    std::vector<unsigned long> adjacencyOffset(numVertices + 1, 0);
+    for (unsigned int v = 0; v < numVertices; v++)
+        adjacencyOffset[v + 1] = adjacencyOffset[v] + live[v];
+    std::vector<unsigned int> adjacency(adjacencyOffset[numVertices]);
+    std::vector<unsigned long> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+    for (unsigned long t = 0; t < numTriangles; t++)
+        for (int k = 0; k < 3; k++)
+            adjacency[fill[indices[3 * t + k]]++] = (unsigned int) t;
+
+    std::vector<unsigned long> cacheTime(numVertices, 0);
+    std::vector<bool> emitted(numTriangles, false);
+    std::vector<unsigned int> deadEnd;
+    std::vector<unsigned int> candidates;
+    std::vector<unsigned int> result;
+    result.reserve(numTriangles * 3);
+
+    unsigned long timestamp = cacheSize + 1;
+    unsigned int cursor = 0;
+    long fan = indices[0];
+
+    while (fan >= 0)
+    {
+        // emit every remaining triangle around the fanning vertex
+        candidates.clear();
+        for (unsigned long a = adjacencyOffset[fan]; a < adjacencyOffset[fan + 1]; a++)
+        {
+            unsigned int t = adjacency[a];
+            if (emitted[t])
+                continue;
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int v = indices[3 * t + k];
+                result.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (timestamp - cacheTime[v] > cacheSize)
+                    cacheTime[v] = timestamp++;
+            }
+            emitted[t] = true;
+        }
+
+        // next fan: the candidate that stays in the cache longest while still
+        // having triangles left, preferring ones whose triangles all fit
+        fan = -1;
+        long bestPriority = -1;
+        for (unsigned long c = 0; c < candidates.size(); c++)
+        {
+            unsigned int v = candidates[c];
+            if (live[v] == 0)
+                continue;
+            long priority = 0;
+            if (timestamp - cacheTime[v] + 2 * live[v] <= cacheSize)
+                priority = (long) (timestamp - cacheTime[v]);
+            if (priority > bestPriority)
+            {
+                bestPriority = priority;
+                fan = v;
+            }
+        }
+
+        // dead end: back up through recently used vertices, then scan onwards
+        while (fan < 0 && !deadEnd.empty())
+        {
+            unsigned int v = deadEnd.back();
+            deadEnd.pop_back();
+            if (live[v] > 0)
+                fan = v;
+        }
+        while (fan < 0 && cursor < numVertices)
+        {
+            if (live[cursor] > 0)
+                fan = cursor;
+            cursor++;
+        }
+    }
+
+    indices.swap(result);
+}
+
+std::vector<unsigned int> optimizeVertexFetch(std::vector<unsigned int> &indices, unsigned int numVertices)
+{
+    std::vector<unsigned int> remap(numVertices, ~0u);
+    unsigned int next = 0;
+    for (unsigned long i = 0; i < indices.size(); i++)
+    {
+        unsigned int v = indices[i];
+        if (remap[v] == ~0u)
+            remap[v] = next++;
+        indices[i] = remap[v];
+    }
+    return remap;
+}
+
+std::vector<unsigned int> optimizeVertexLocality(std::vector<unsigned int> &indices, const float *positions,
+                                                 unsigned int numVertices)
+{
+    float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (unsigned int v = 0; v < numVertices; v++)
+        for (int a = 0; a < 3; a++)
+        {
+            lo[a] = std::min(lo[a], positions[3 * v + a]);
+            hi[a] = std::max(hi[a], positions[3 * v + a]);
+        }
+    // one scale for all axes, so the curve's cells are cubes
+    float extent = std::max(hi[0] - lo[0], std::max(hi[1] - lo[1], hi[2] - lo[2]));
+    float scale = extent > 0.0f ? 2097151.0f / extent : 0.0f;
+
+    // (code, vertex) pairs; sorting them keeps vertices with equal codes in order
+    std::vector<std::pair<uint64_t, unsigned int> > order(numVertices);
+    long v;
+    #pragma omp parallel for
+    for (v = 0; v < (long) numVertices; v++)
+    {
+        uint64_t code = 0;
+        for (int a = 0; a < 3; a++)
+            code |= spreadBits((uint64_t) ((positions[3 * v + a] - lo[a]) * scale)) << a;
+        order[v] = std::make_pair(code, (unsigned int) v);
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<unsigned int> remap(numVertices);
+    for (unsigned int k = 0; k < numVertices; k++)
+        remap[order[k].second] = k;
+    for (unsigned long i = 0; i < indices.size(); i++)
+        indices[i] = remap[indices[i]];
+    return remap;
+}
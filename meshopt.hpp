@@ -0,0 +1,34 @@
+#ifndef MESHOPT_HPP
+#define MESHOPT_HPP
+
+#include <vector>
+
+// Index buffer optimisation for triangle lists.
+
+// Average cache miss ratio: vertices transformed per triangle when the index
+// buffer is drawn through a FIFO post-transform cache of the given size.
+// 3.0 is the worst case; well ordered meshes get close to 0.6.
+float meshACMR(const std::vector<unsigned int> &indices, unsigned int numVertices,
+               unsigned int cacheSize = 16);
+
+// Reorders triangles for post-transform vertex cache reuse, using the
+// Tipsify algorithm (Sander, Nehab and Barczak, 2007). Runs in linear time
+// and keeps the winding of every triangle.
+void optimizeVertexCache(std::vector<unsigned int> &indices, unsigned int numVertices,
+                         unsigned int cacheSize = 16);
+
+// Renumbers vertices in the order the index buffer first uses them, so the
+// vertex arrays are read front to back. Returns remap, where remap[old] is
+// the new index of each vertex (~0u for unused vertices); the caller moves
+// the vertex attributes accordingly.
+std::vector<unsigned int> optimizeVertexFetch(std::vector<unsigned int> &indices, unsigned int numVertices);
+
+// Renumbers vertices along a 3D Morton (Z-order) curve through their
+// bounding box instead, so vertices close in space are close in the vertex
+// arrays and a pass over them in order, such as a nearest neighbour query
+// per vertex, walks the other model coherently too. positions holds 3 floats
+// per vertex. Returns remap as optimizeVertexFetch() does.
+std::vector<unsigned int> optimizeVertexLocality(std::vector<unsigned int> &indices, const float *positions,
+                                                 unsigned int numVertices);
+
+#endif
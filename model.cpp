@@ -1,6 +1,7 @@
 #include "model.hpp"
-#include <fstream>
-#include <sstream>
+#include "meshcache.hpp"
+#include "meshopt.hpp"
+#include "icp.hpp"
 #include <iostream>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/quaternion.hpp>
@@ -8,7 +9,9 @@
 #include <glm/gtx/fast_square_root.hpp>
 #include <SOIL.h>
 #include <omp.h>
-#include <unordered_set>
+#include <unordered_map>
+#include <string.h>
+#include <float.h>
 
 using namespace std;
 
@@ -33,55 +36,132 @@ Model::Model(const char *path, glm::vec3 position, const char *texturePath)
         loadColorOBJ(path);
 }
 
+Model::~Model()
+{
+    cancelProjection();
+    if (m_warpThread.joinable())
+        m_warpThread.join();
+    delete m_positionIndex;
+}
+
+
+
+int Model::s_loadThreads = 0;
+bool Model::s_indexed = true;
+bool Model::s_mortonOrder = false;
+SpatialIndexType Model::s_spatialIndex = SPATIAL_INDEX_KDTREE;
+bool Model::s_surfaceProjection = true;
+float Model::s_reprojectionTolerance = 0.05f;
+float Model::s_projectionEpsilon = 0.0f;
+bool Model::s_checkProjection = false;
+
+namespace
+{
+    struct TupleHash
+    {
+        size_t operator()(const ObjIndexTuple &t) const
+        {
+            size_t h = (size_t) (unsigned) t.v * 73856093u;
+            h ^= (size_t) (unsigned) t.vt * 19349663u;
+            h ^= (size_t) (unsigned) t.vn * 83492791u;
+            return h;
+        }
+    };
 
+    struct TupleEqual
+    {
+        bool operator()(const ObjIndexTuple &a, const ObjIndexTuple &b) const
+        {
+            return a.v == b.v && a.vt == b.vt && a.vn == b.vn;
+        }
+    };
+
+    // positions compare by their bits, so the welding is exact
+    struct PositionHash
+    {
+        size_t operator()(const glm::vec3 &p) const
+        {
+            uint32_t bits[3];
+            memcpy(bits, &p, sizeof(bits));
+            size_t h = (size_t) bits[0] * 73856093u;
+            h ^= (size_t) bits[1] * 19349663u;
+            h ^= (size_t) bits[2] * 83492791u;
+            return h;
+        }
+    };
+
+    struct PositionEqual
+    {
+        bool operator()(const glm::vec3 &a, const glm::vec3 &b) const
+        {
+            return memcmp(&a, &b, sizeof(a)) == 0;
+        }
+    };
+}
+
+// Welds corners with identical v/vt pairs (or v alone, with positionOnly)
+// into one vertex each, and writes the vertex of every corner to indices.
+// Normals are not part of the key: scans carry one normal per face, which
+// would otherwise keep every corner distinct.
+static void weldCorners(const ObjIndexTuple *corners, long numCorners, bool positionOnly,
+                        std::vector<ObjIndexTuple> &vertices, std::vector<unsigned int> &indices)
+{
+    std::unordered_map<ObjIndexTuple, unsigned int, TupleHash, TupleEqual> vertexMap;
+    vertexMap.reserve(numCorners / 4);
+    vertices.clear();
+    indices.resize(numCorners);
+
+    for (long i = 0; i < numCorners; i++)
+    {
+        ObjIndexTuple key = corners[i];
+        key.vn = -1;
+        if (positionOnly)
+            key.vt = -1;
+        std::pair<std::unordered_map<ObjIndexTuple, unsigned int, TupleHash, TupleEqual>::iterator, bool> inserted =
+            vertexMap.insert(std::make_pair(key, (unsigned int) vertices.size()));
+        if (inserted.second)
+            vertices.push_back(corners[i]);
+        indices[i] = inserted.first->second;
+    }
+}
 
 int Model::loadColorOBJ(const char *path)
 {
     cerr << "Loading model from file " << path << endl;
-    std::ifstream infile(path);
-    
-    std::vector<glm::vec3> positionList;
-    std::vector<glm::vec3> colorList;
-    
-    
-    string line, label;
+    m_path = path;
+    MeshCache mesh;
+    if (!mesh.load(path, true, s_loadThreads))
+    {
+        fprintf(stderr, "Error: could not open %s\n", path);
+        return -1;
+    }
     
-    // for vertex list and color list
-    float v0, v1, v2, c0, c1, c2;
+    const glm::vec3 *positionList = (const glm::vec3 *) mesh.positions();
+    const glm::vec3 *colorList = (const glm::vec3 *) mesh.colors();
+    const ObjIndexTuple *corners = mesh.corners();
+    long numCorners = (long) mesh.numCorners();
+    std::vector<ObjIndexTuple> weldedVertices;
+    if (s_indexed)
+    {
+        weldCorners(corners, numCorners, true, weldedVertices, m_indexVector);
+        corners = weldedVertices.data();
+        numCorners = (long) weldedVertices.size();
+    }
+    m_positionVector.resize(numCorners);
+    m_colorVector.resize(numCorners);
     
-    // for faces
-    unsigned int index[3];
-    while (getline(infile, line))
+    long i;
+    #pragma omp parallel for if (s_loadThreads != 1)
+    for (i = 0; i < numCorners; i++)
     {
-        istringstream iss(line);
-        iss >> label;
-        switch (label[0])
-        {
-            case ('v'):
-            {
-                iss >> v0 >> v1 >> v2 >> c0 >> c1 >> c2;
-                positionList.push_back(glm::vec3(v0, v1, v2));
-                colorList.push_back(glm::vec3(c0, c1, c2));
-                break;
-            }
-            case ('f'):
-            {
-                iss >> index[0] >> index[1] >> index[2];
-                for (int i = 0; i < 3; i++)
-                {
-                    m_positionVector.push_back(positionList[index[i] - 1]);
-                    m_colorVector.push_back(colorList[index[i] - 1]);
-                }
-                break;
-            }
-            default:
-            {
-                continue;
-            }
-        }
+        int index = corners[i].v;
+        m_positionVector[i] = positionList[index];
+        m_colorVector[i] = colorList[index];
     }
     
     m_numVertices = m_positionVector.size();
+    optimizeIndices();
+    uploadIndices();
     
     glBindBuffer(GL_ARRAY_BUFFER, m_positionVBO);
     glBufferData(GL_ARRAY_BUFFER,
@@ -104,92 +184,71 @@ int Model::loadColorOBJ(const char *path)
 int Model::loadTextureOBJ(const char *objPath, const char *texturePath)
 {
     cerr << "Loading texture model from file " << objPath << endl;
-    std::ifstream infile(objPath);
-    
-    std::vector<glm::vec3> positionList;
-    std::vector<glm::vec2> textureList;
-    std::vector<glm::vec3> normalList;
+    m_path = objPath;
+    MeshCache mesh;
+    if (!mesh.load(objPath, false, s_loadThreads))
+    {
+        fprintf(stderr, "Error: could not open %s\n", objPath);
+        return -1;
+    }
+    if (mesh.unsupported())
+    {
+        fprintf(stderr, "Error: \"v%c\" not yet supported\n", mesh.unsupported());
+        return -1;
+    }
     
+    long numPositions = (long) mesh.numPositions();
+    const float *positions = mesh.positions();
+    std::vector<glm::vec3> positionList(numPositions);
+    for (long i = 0; i < numPositions; i++)
+        positionList[i] = glm::vec3(SCALE_FACE * positions[3 * i],
+                                    SCALE_FACE * positions[3 * i + 1],
+                                    SCALE_FACE * positions[3 * i + 2]);
+    const glm::vec2 *textureList = (const glm::vec2 *) mesh.texcoords();
+    const glm::vec3 *normalList = (const glm::vec3 *) mesh.normals();
+    m_normal = mesh.numNormals() > 0;
     
-    string line, label;
+    const ObjIndexTuple *corners = mesh.corners();
+    long numCorners = (long) mesh.numCorners();
+    std::vector<ObjIndexTuple> weldedVertices;
+    if (s_indexed)
+    {
+        weldCorners(corners, numCorners, false, weldedVertices, m_indexVector);
+        corners = weldedVertices.data();
+        numCorners = (long) weldedVertices.size();
+    }
+    m_positionVector.resize(numCorners);
+    m_textureVector.resize(numCorners);
+    if (m_normal)
+        m_normalVector.resize(numCorners);
     
-    // for vertex list
-    float v0, v1, v2, t0, t1, n0, n1, n2;
+    long i;
+    #pragma omp parallel for if (s_loadThreads != 1)
+    for (i = 0; i < numCorners; i++)
+    {
+        const ObjIndexTuple &corner = corners[i];
+        m_positionVector[i] = positionList[corner.v];
+        m_textureVector[i] = corner.vt >= 0 ? textureList[corner.vt] : glm::vec2(0.0f);
+        if (m_normal)
+            m_normalVector[i] = corner.vn >= 0 ? normalList[corner.vn] : glm::vec3(0.0f);
+    }
     
-    // for faces
-    std::string indexTupleString;
-    while (getline(infile, line))
+    // welded vertices average the normals of the faces around them
+    if (s_indexed && m_normal)
     {
-        istringstream iss(line);
-        iss >> label;
-        if (!label.length())
-            continue;
-        switch (label[0])
-        {
-            case ('v'):
-            {
-                if (label.length() == 1)
-                {
-                    iss >> v0 >> v1 >> v2;
-                    positionList.push_back(glm::vec3(SCALE_FACE * v0, SCALE_FACE * v1, SCALE_FACE * v2));
-                }
-                else if (label[1] == 't')
-                {
-                    iss >> t0 >> t1;
-                    textureList.push_back(glm::vec2(t0, t1));
-                }
-                else if (label[1] == 'n')
-                {
-                    m_normal = true;
-                    iss >> n0 >> n1 >> n2;
-                    normalList.push_back(glm::vec3(n0, n1, n2));
-                }
-                else
-                {
-                    fprintf(stderr, "Error: \"v%c\" not yet supported\n", label[1]);
-                    return -1;
-                }
-                break;
-            }
-            case ('f'):
-            {
-                unsigned int delimiterLoc;
-                unsigned int vIndex, vtIndex, vnIndex;
-                string indexTupleString;
-                string vIndexString, vtIndexString, vnIndexString;
-                
-                for (int i = 0; i < 3; i++)
-                {
-                    iss >> indexTupleString;
-                    delimiterLoc = (unsigned int) indexTupleString.find("/");
-                    vIndexString = indexTupleString.substr(0, delimiterLoc);
-                    vtIndexString = indexTupleString.substr(delimiterLoc + 1);
-
-                    if (m_normal)
-                    {
-                        delimiterLoc = (unsigned int) vtIndexString.find("/");
-                        vnIndexString = vtIndexString.substr(delimiterLoc + 1);
-                        vtIndexString = vtIndexString.substr(0, delimiterLoc);
-
-                        vnIndex = atoi(vnIndexString.c_str());
-                        m_normalVector.push_back(normalList[vnIndex - 1]);
-                    }
-
-                    vIndex = atoi(vIndexString.c_str());
-                    vtIndex = atoi(vtIndexString.c_str());
-                    m_positionVector.push_back(positionList[vIndex - 1]);
-                    m_textureVector.push_back(textureList[vtIndex - 1]);
-                }
-                break;
-            }
-            default:
-            {
-                continue;
-            }
-        }
+        const ObjIndexTuple *objCorners = mesh.corners();
+        std::fill(m_normalVector.begin(), m_normalVector.end(), glm::vec3(0.0f));
+        for (unsigned long k = 0; k < m_indexVector.size(); k++)
+            if (objCorners[k].vn >= 0)
+                m_normalVector[m_indexVector[k]] += normalList[objCorners[k].vn];
+        for (i = 0; i < numCorners; i++)
+            if (glm::dot(m_normalVector[i], m_normalVector[i]) > 0.0f)
+                m_normalVector[i] = glm::normalize(m_normalVector[i]);
     }
     
     m_numVertices = m_positionVector.size();
+    optimizeIndices();
+    uploadIndices();
     
     glBindBuffer(GL_ARRAY_BUFFER, m_positionVBO);
     glBufferData(GL_ARRAY_BUFFER,
@@ -236,8 +295,41 @@ glm::mat4 Model::model() const
     
 }
 
+// Inverse of model() for a rigid transform
+void Model::setPose(const glm::mat4 &pose)
+{
+    m_position = glm::vec3(pose[3]);
+    glm::vec3 angles = glm::eulerAngles(glm::quat_cast(glm::mat3(pose)));
+    m_pitch = angles.x;
+    m_yaw = angles.y;
+    m_roll = angles.z;
+}
+
+// A click on the warped mesh lands on a warped position; the marker goes to
+// where the vertex nearest the click was loaded, so the warp's control
+// points stay on the model as loaded, and is drawn where it was clicked
 void Model::setMarker(glm::vec3 position)
 {
+    if (m_warped)
+    {
+        // the mesh is drawn warped, so snap to the nearest warped position
+        // and mark the unwarped one there; each position once, not per vertex
+        float bestScore = FLT_MAX;
+        unsigned long best = 0;
+        for (unsigned long u = 0; u < m_warpedUniqueVector.size(); u++)
+        {
+            glm::vec3 diff = m_warpedUniqueVector[u] - position;
+            float score = glm::dot(diff, diff);
+            if (score < bestScore)
+            {
+                bestScore = score;
+                best = u;
+            }
+        }
+        m_markers.push_back(Marker(m_uniquePositionVector[best]));
+        m_markers.back().place(m_warpedUniqueVector[best]);
+        return;
+    }
     m_markers.push_back(Marker(position));
 }
 
@@ -250,6 +342,207 @@ void Model::undoMarker()
     }
 }
 
+bool Model::warpToMarkers(Model *target)
+{
+    unsigned long numPairs = std::min(numMarkers(), target->numMarkers());
+    if (numPairs == 0)
+    {
+        bool wasWarped = m_warped;
+        clearWarp();
+        return wasWarped;
+    }
+    bool uploaded = uploadWarp();
+
+    // keep the markers still there, in the same place, and the landmarks
+    // made from them
+    unsigned long keep = 0;
+    while (keep < m_warpMarkerVector.size() && keep < numPairs && m_warpMarkerVector[keep] == m_markers[keep].center())
+        keep++;
+    if (keep < m_warpMarkerVector.size() || keep < numPairs)
+        m_warpStale = true;
+    m_warpMarkerVector.resize(keep);
+    m_warpSlotVector.resize(keep);
+    unsigned int numLandmarks = 0;
+    for (unsigned long i = 0; i < keep; i++)
+        if (m_warpSlotVector[i] >= 0)
+            numLandmarks++;
+    while (m_warpFit.size() > numLandmarks)
+        m_warpFit.pop();
+
+    // the target's markers in this model's space, which moves them whenever
+    // either model moves
+    glm::mat4 toModel = glm::inverse(model()) * target->model();
+    for (unsigned long i = 0; i < numPairs; i++)
+    {
+        glm::vec3 goal(toModel * glm::vec4(target->m_markers[i].center(), 1.0f));
+        if (i < keep)
+        {
+            int slot = m_warpSlotVector[i];
+            if (slot >= 0 && goal != m_warpFit.target(slot))
+            {
+                m_warpFit.setTarget(slot, goal);
+                m_warpStale = true;
+            }
+            continue;
+        }
+        int slot = -1;
+        if (m_warpFit.push(m_markers[i].center(), goal))
+            slot = (int) m_warpFit.size() - 1;
+        else
+            fprintf(stderr, "Marker %lu is where an earlier one is; leaving it out of the warp\n", i + 1);
+        m_warpMarkerVector.push_back(m_markers[i].center());
+        m_warpSlotVector.push_back(slot);
+    }
+
+    if (m_warpStale && !m_warpRunning)
+        startWarp();
+    return uploaded;
+}
+
+// Puts the model as loaded back in m_positionVBO
+void Model::clearWarp()
+{
+    if (m_warpThread.joinable())
+        m_warpThread.join();
+    m_warpRunning = false;
+    m_warpDone = false;
+    m_warpStale = false;
+    m_warpReported = 0;
+    m_warpFit.clear();
+    m_warpMarkerVector.clear();
+    m_warpSlotVector.clear();
+    if (!m_warped)
+        return;
+    glBindBuffer(GL_ARRAY_BUFFER, m_positionVBO);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, m_numVertices * sizeof(glm::vec3), &m_positionVector[0]);
+    m_warped = false;
+    placeMarkers();
+}
+
+// Solves the fit on the GL thread, O(p^2), and warps the vertices by it on
+// a worker, leaving one core to the render loop. Kernel terms are summed in
+// float, as for a preview; see TPSWarp.
+void Model::startWarp()
+{
+    if (m_warpThread.joinable())
+        m_warpThread.join();
+    findUniquePositions();
+    m_warpFit.solve(m_pendingWarp);
+    m_pendingWarp.setPrecision(TPSWarp::PRECISION_FLOAT);
+    m_warpStale = false;
+    m_warpStart = omp_get_wtime();
+    m_warpRunning = true;
+    const glm::vec3 *shown = m_warped ? &m_warpedPositionVector[0] : &m_positionVector[0];
+    int threads = std::max(1, omp_get_num_procs() - 1);
+    m_warpThread = std::thread([this, shown, threads]()
+    {
+        computeWarp(shown, threads);
+        m_warpDone = true;
+    });
+}
+
+// Worker side: warps each unique position once, scatters the result to the
+// vertices there, and marks the blocks that differ from what is shown
+void Model::computeWarp(const glm::vec3 *shown, int threads)
+{
+    long numPositions = (long) m_uniquePositionVector.size();
+    m_warpBuffer.resize(3 * numPositions);
+    long u;
+    #pragma omp parallel for num_threads(threads)
+    for (u = 0; u < numPositions; u++)
+    {
+        m_warpBuffer[3 * u + 0] = m_uniquePositionVector[u].x;
+        m_warpBuffer[3 * u + 1] = m_uniquePositionVector[u].y;
+        m_warpBuffer[3 * u + 2] = m_uniquePositionVector[u].z;
+    }
+    omp_set_num_threads(threads);
+    m_pendingWarp.warp(&m_warpBuffer[0], numPositions);
+
+    m_pendingWarpedUniqueVector.resize(numPositions);
+    #pragma omp parallel for num_threads(threads)
+    for (u = 0; u < numPositions; u++)
+    {
+        const double *p = &m_warpBuffer[3 * u];
+        m_pendingWarpedUniqueVector[u] = glm::vec3((float) p[0], (float) p[1], (float) p[2]);
+    }
+
+    m_pendingWarpedVector.resize(m_numVertices);
+    long numBlocks = (long) ((m_numVertices + WARP_UPLOAD_BLOCK - 1) / WARP_UPLOAD_BLOCK);
+    m_warpDirty.assign(numBlocks, 0);
+    long b;
+    #pragma omp parallel for num_threads(threads)
+    for (b = 0; b < numBlocks; b++)
+    {
+        unsigned long first = b * WARP_UPLOAD_BLOCK;
+        unsigned long last = std::min(first + WARP_UPLOAD_BLOCK, m_numVertices);
+        for (unsigned long i = first; i < last; i++)
+            m_pendingWarpedVector[i] = m_pendingWarpedUniqueVector[m_uniqueIndexVector[i]];
+        m_warpDirty[b] = memcmp(&m_pendingWarpedVector[first], &shown[first], (last - first) * sizeof(glm::vec3)) != 0;
+    }
+}
+
+// GL side: once the worker is done, uploads each run of changed blocks in
+// place with glBufferSubData
+bool Model::uploadWarp()
+{
+    if (!m_warpRunning || !m_warpDone)
+        return false;
+    m_warpThread.join();
+    m_warpRunning = false;
+    m_warpDone = false;
+
+    double start = omp_get_wtime();
+    unsigned long numBlocks = m_warpDirty.size(), uploaded = 0;
+    glBindBuffer(GL_ARRAY_BUFFER, m_positionVBO);
+    for (unsigned long b = 0; b < numBlocks; )
+    {
+        if (!m_warpDirty[b])
+        {
+            b++;
+            continue;
+        }
+        unsigned long end = b;
+        while (end < numBlocks && m_warpDirty[end])
+            end++;
+        unsigned long first = b * WARP_UPLOAD_BLOCK;
+        unsigned long last = std::min(end * WARP_UPLOAD_BLOCK, m_numVertices);
+        glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(glm::vec3), (last - first) * sizeof(glm::vec3),
+                        &m_pendingWarpedVector[first]);
+        uploaded += last - first;
+        b = end;
+    }
+    m_warpedPositionVector.swap(m_pendingWarpedVector);
+    m_warpedUniqueVector.swap(m_pendingWarpedUniqueVector);
+    m_warped = true;
+    placeMarkers();
+    if (m_pendingWarp.numPoints() != m_warpReported)
+    {
+        fprintf(stderr, "Warped by %u landmarks: %.1fms, uploaded %lu of %lu vertices in %.1fms\n",
+                m_pendingWarp.numPoints(), 1000.0 * (start - m_warpStart), uploaded, m_numVertices,
+                1000.0 * (omp_get_wtime() - start));
+        m_warpReported = m_pendingWarp.numPoints();
+    }
+    return true;
+}
+
+// Moves each marker's cube to where the mesh is drawn at its center: by the
+// warp just uploaded while warped, else the center itself. Called on the GL
+// thread once the worker is done with m_pendingWarp.
+void Model::placeMarkers()
+{
+    unsigned long numMarkers = m_markers.size();
+    if (numMarkers == 0)
+        return;
+    std::vector<double> shown(3 * numMarkers);
+    for (unsigned long i = 0; i < numMarkers; i++)
+        for (int k = 0; k < 3; k++)
+            shown[3 * i + k] = m_markers[i].center()[k];
+    if (m_warped)
+        m_pendingWarp.warp(&shown[0], numMarkers);
+    for (unsigned long i = 0; i < numMarkers; i++)
+        m_markers[i].place(glm::vec3((float) shown[3 * i], (float) shown[3 * i + 1], (float) shown[3 * i + 2]));
+}
+
 void Model::drawMarkers(GLuint program) const
 {
     if (m_markers.empty())
@@ -295,63 +588,526 @@ float correspondenceScore(glm::vec3 p1, glm::vec3 p2)
 
 
 
-// Use ICP to project points onto another model, O(mn)
+// Hash of the mesh as built into the search structures, which their files
+// must match: the positions, and for a BVH the triangles too
+uint64_t Model::meshKey(bool withIndices) const
+{
+    uint64_t key = MeshCache::hash((const char *) m_positionVector.data(), m_positionVector.size() * sizeof(glm::vec3));
+    if (withIndices)
+        key = key * 1099511628211ULL ^
+              MeshCache::hash((const char *) m_indexVector.data(), m_indexVector.size() * sizeof(unsigned int));
+    return key;
+}
+
+// "<obj>.<extension>", or empty for a model not loaded from a file. One file
+// per structure: the mesh key is checked against the one in its header, and
+// a structure rebuilt for a changed mesh replaces the file
+std::string Model::indexFilePath(const char *extension) const
+{
+    if (m_path.empty())
+        return std::string();
+    return m_path + "." + extension;
+}
+
+const SpatialIndex &Model::positionIndex()
+{
+    if (!m_positionIndex || m_positionIndexType != s_spatialIndex ||
+        (m_positionIndex->empty() && !m_positionVector.empty()))
+    {
+        delete m_positionIndex;
+        m_positionIndexType = s_spatialIndex;
+        m_positionIndex = SpatialIndex::create(m_positionIndexType);
+        // only the k-d tree is worth keeping; brute force just copies the points
+        uint64_t key = 0;
+        std::string path;
+        if (m_positionIndexType == SPATIAL_INDEX_KDTREE)
+        {
+            key = meshKey(false);
+            path = indexFilePath("kdtree");
+        }
+        if (!path.empty() && m_positionIndex->load(path.c_str(), key))
+            fprintf(stderr, "Mapped %s from %s\n", SpatialIndex::name(m_positionIndexType), path.c_str());
+        else
+        {
+            fprintf(stderr, "Building %s over %lu vertices...\n",
+                    SpatialIndex::name(m_positionIndexType), m_positionVector.size());
+            m_positionIndex->setSpacing(meanEdgeLength());
+            m_positionIndex->build(m_positionVector);
+            if (!path.empty() && !m_positionIndex->save(path.c_str(), key))
+                fprintf(stderr, "Warning: could not write %s\n", path.c_str());
+        }
+    }
+    return *m_positionIndex;
+}
+
+const std::vector<glm::vec3> &Model::surfaceNormals()
+{
+    if (!m_normal && !m_positionVector.empty())
+    {
+        computeVertexNormals(m_positionVector, m_indexVector, m_normalVector);
+        m_normal = true;
+    }
+    return m_normalVector;
+}
+
+// Moves this model onto another by ICP, starting from the current poses
+void Model::alignTo(Model *target, int metric)
+{
+    fprintf(stderr, "Aligning by ICP...\n");
+    double start = omp_get_wtime();
+
+    ICPOptions options;
+    options.metric = (ICPMetric) metric;
+    ICPResult result = icpAlign(m_positionVector, surfaceNormals(), model(),
+                                *target->positionVector(), target->surfaceNormals(),
+                                target->positionIndex(), target->model(), options);
+    setPose(result.pose);
+
+    fprintf(stderr, "%s after %u iterations: RMS %g over %lu pairs (%.3fs)\n",
+            result.converged ? "Converged" : "Stopped", result.iterations, result.rms, result.pairs,
+            omp_get_wtime() - start);
+}
+
+const TriangleBVH &Model::surfaceBVH()
+{
+    if (m_surfaceBVH.empty() && !m_positionVector.empty())
+    {
+        uint64_t key = meshKey(true);
+        std::string path = indexFilePath("bvh");
+        if (!path.empty() && m_surfaceBVH.load(path.c_str(), key))
+            fprintf(stderr, "Mapped BVH from %s\n", path.c_str());
+        else
+        {
+            fprintf(stderr, "Building BVH over %lu triangles...\n",
+                    (m_indexVector.empty() ? m_positionVector.size() : m_indexVector.size()) / 3);
+            m_surfaceBVH.build(m_positionVector, m_indexVector);
+            if (!path.empty() && !m_surfaceBVH.save(path.c_str(), key))
+                fprintf(stderr, "Warning: could not write %s\n", path.c_str());
+        }
+    }
+    return m_surfaceBVH;
+}
+
+float Model::meanEdgeLength()
+{
+    if (m_meanEdgeLength == 0.0f && !m_positionVector.empty())
+    {
+        // edges shared by two triangles count twice
+        unsigned long numCorners = m_indexVector.empty() ? m_positionVector.size() : m_indexVector.size();
+        double sum = 0.0;
+        for (unsigned long k = 0; k + 2 < numCorners; k += 3)
+        {
+            const glm::vec3 &a = m_positionVector[m_indexVector.empty() ? k : m_indexVector[k]];
+            const glm::vec3 &b = m_positionVector[m_indexVector.empty() ? k + 1 : m_indexVector[k + 1]];
+            const glm::vec3 &c = m_positionVector[m_indexVector.empty() ? k + 2 : m_indexVector[k + 2]];
+            sum += glm::length(b - a) + glm::length(c - b) + glm::length(a - c);
+        }
+        if (numCorners >= 3)
+            m_meanEdgeLength = (float) (sum / (numCorners / 3 * 3));
+    }
+    return m_meanEdgeLength;
+}
+
+namespace
+{
+    // What a projection searches. The target's BVH or spatial index is
+    // fetched on the GL thread, where it may be built, saved and replaced,
+    // and the backend is read from s_spatialIndex; workers are handed the
+    // result and only read through it.
+    struct ProjectionTarget
+    {
+        const TriangleBVH *bvh;
+        const SpatialIndex *tree;
+        const std::vector<glm::vec3> *positions;
+        const std::vector<glm::vec2> *textures;
+        const std::vector<unsigned int> *indices;
+        float epsilon;
+    };
+
+    // Fills search from a structure already fetched; only reads the target
+    bool useProjectionTarget(Model *target, const TriangleBVH *bvh, const SpatialIndex *tree, float epsilon,
+                             ProjectionTarget &search)
+    {
+        search.bvh = bvh;
+        search.tree = tree;
+        search.positions = target->positionVector();
+        search.textures = target->textureVector();
+        search.indices = target->indexVector();
+        search.epsilon = epsilon;
+        return bvh ? !bvh->empty() : (tree && !tree->empty());
+    }
+
+    // GL thread only
+    bool findProjectionTarget(Model *target, bool surface, float epsilon, ProjectionTarget &search)
+    {
+        if (surface)
+            return useProjectionTarget(target, &target->surfaceBVH(), (const SpatialIndex*) 0, epsilon, search);
+        return useProjectionTarget(target, (const TriangleBVH*) 0, &target->positionIndex(), epsilon, search);
+    }
+
+    // Projects query, given in the target's model space, onto the target's
+    // surface or nearest vertex. hit is the triangle or vertex found, and on
+    // entry the one to start from, or -1.
+    void projectPoint(const ProjectionTarget &search, const glm::vec3 &query, int &hit,
+                      glm::vec3 &point, glm::vec2 &texture)
+    {
+        if (search.bvh)
+        {
+            SurfacePoint surface;
+            search.bvh->closestPoint(query, surface, hit, search.epsilon);
+            const std::vector<unsigned int> &indices = *search.indices;
+            unsigned int t = (unsigned int) surface.triangle;
+            unsigned int a = indices.empty() ? 3 * t : indices[3 * t];
+            unsigned int b = indices.empty() ? 3 * t + 1 : indices[3 * t + 1];
+            unsigned int c = indices.empty() ? 3 * t + 2 : indices[3 * t + 2];
+            hit = surface.triangle;
+            point = surface.position;
+            texture = (*search.textures)[a] * surface.barycentric.x +
+                      (*search.textures)[b] * surface.barycentric.y +
+                      (*search.textures)[c] * surface.barycentric.z;
+        }
+        else
+        {
+            hit = search.tree->nearestFrom(query, hit, search.epsilon);
+            point = (*search.positions)[hit];
+            texture = (*search.textures)[hit];
+        }
+    }
+}
+
+// Welds vertices at bitwise equal positions, once; projections search from
+// the welded positions, and warps move them, scattering their results to
+// every vertex there
+void Model::findUniquePositions()
+{
+    if (!m_uniqueIndexVector.empty() || m_positionVector.empty())
+        return;
+
+    std::unordered_map<glm::vec3, unsigned int, PositionHash, PositionEqual> positionMap;
+    positionMap.reserve(m_numVertices);
+    m_uniqueIndexVector.resize(m_numVertices);
+    for (unsigned long i = 0; i < m_numVertices; i++)
+    {
+        std::pair<std::unordered_map<glm::vec3, unsigned int, PositionHash, PositionEqual>::iterator, bool> inserted =
+            positionMap.insert(std::make_pair(m_positionVector[i], (unsigned int) m_uniquePositionVector.size()));
+        if (inserted.second)
+            m_uniquePositionVector.push_back(m_positionVector[i]);
+        m_uniqueIndexVector[i] = inserted.first->second;
+    }
+    fprintf(stderr, "%lu unique positions among %lu vertices\n",
+            m_uniquePositionVector.size(), m_numVertices);
+}
+
+// This model's pose in the target's model space, where projections are found
+glm::mat4 Model::poseIn(Model *target) const
+{
+    return glm::inverse(target->model()) * model();
+}
+
+// True if the projection shown is onto target, in the current mode and
+// poses, and at least as accurate as epsilon asks
+bool Model::projectionCurrent(Model *target, float epsilon) const
+{
+    return m_projected && target == m_projectionTarget && m_projectionSurface == s_surfaceProjection &&
+           m_projectionEpsilon <= epsilon && poseIn(target) == m_projectionPose;
+}
+
+// Moves each vertex to the closest point on another model's surface, taking
+// the texture coordinate interpolated there; or, without surface projection,
+// snaps it to the nearest vertex. O(n log m) either way. Blocks until done.
 void Model::projectOnto(Model *target)
 {
-    if (m_projected)
+    if (projecting() || projectionCurrent(target, s_projectionEpsilon))
         return;
 
-    fprintf(stderr, "Constructing projection...\n");
+    if (s_projectionEpsilon > 0.0f)
+        fprintf(stderr, "Constructing projection within %g%%...\n", 100.0f * s_projectionEpsilon);
+    else
+        fprintf(stderr, "Constructing projection...\n");
+    double start = omp_get_wtime();
+
+    beginProjection(target, s_projectionEpsilon);
+    if (computeProjection(target, omp_get_max_threads()))
+    {
+        uploadProjection();
+        fprintf(stderr, "DONE! (%.3fs)\n", omp_get_wtime() - start);
+        if (s_checkProjection)
+            reportProjectionError();
+    }
+}
+
+// Runs projectOnto() on a worker thread, leaving one core to the render loop.
+// The worker writes only the pending vectors and the progress counters;
+// updateProjection() hands its result to GL.
+bool Model::startProjection(Model *target)
+{
+    if (projecting() || projectionCurrent(target, 0.0f))
+        return false;
+    if (m_projectionThread.joinable())
+        m_projectionThread.join();
+
+    fprintf(stderr, "Constructing projection in the background...\n");
+    if (!beginProjection(target, 0.0f))
+        return false;
+    m_projectionStart = omp_get_wtime();
+    m_projectionRunning = true;
+    int threads = std::max(1, omp_get_num_procs() - 1);
+    m_projectionThread = std::thread([this, target, threads]()
+    {
+        computeProjection(target, threads);
+        m_projectionDone = true;
+    });
+    return true;
+}
+
+void Model::cancelProjection()
+{
+    if (!m_projectionThread.joinable())
+        return;
+    m_projectionCancel = true;
+    m_projectionThread.join();
+    m_projectionRunning = false;
+    m_pendingQueryVector.clear();
+    m_pendingHitVector.clear();
+    m_pendingPointVector.clear();
+    m_pendingPointTextureVector.clear();
+    fprintf(stderr, "Projection cancelled\n");
+}
+
+float Model::projectionProgress() const
+{
+    unsigned long numPositions = m_uniquePositionVector.size();
+    return numPositions ? (float) m_projectionProgress / (float) numPositions : 1.0f;
+}
 
-    std::vector<glm::vec3> *targetPositions = target->positionVector();
-    std::vector<glm::vec2> *targetTextures = target->textureVector();
+// Called from the GL thread every frame
+bool Model::updateProjection()
+{
+    if (!m_projectionRunning)
+        return false;
 
+    int percent = (int) (100.0f * projectionProgress());
+    if (percent / 10 > m_projectionReported / 10 && percent < 100)
+    {
+        fprintf(stderr, "Projection %d%%\n", percent);
+        m_projectionReported = percent;
+    }
+    if (!m_projectionDone)
+        return false;
+
+    m_projectionThread.join();
+    m_projectionRunning = false;
+    if (m_pendingPointVector.size() != m_uniquePositionVector.size())
+        return false;
+    uploadProjection();
+    fprintf(stderr, "DONE! (%.3fs)\n", omp_get_wtime() - m_projectionStart);
+    return true;
+}
+
+// Brings the projection up to date with the current poses. A position whose
+// query point moved less than the tolerance since it was last searched keeps
+// its match; the rest search again starting from theirs, which bounds each
+// search to about the distance moved. Projects from scratch if there is no
+// projection onto target in the current mode, and as accurate as the
+// current epsilon, to start from.
+bool Model::reproject(Model *target)
+{
+    if (projecting() || projectionCurrent(target, s_projectionEpsilon))
+        return false;
+    if (!m_projected || target != m_projectionTarget || m_projectionSurface != s_surfaceProjection ||
+        m_projectionEpsilon > s_projectionEpsilon)
+    {
+        beginProjection(target, s_projectionEpsilon);
+        if (!computeProjection(target, omp_get_max_threads()))
+            return false;
+        uploadProjection();
+        return true;
+    }
 
-    int numTargetPositions = targetPositions->size();
+    ProjectionTarget search;
+    if (!findProjectionTarget(target, m_projectionSurface, s_projectionEpsilon, search))
+        return false;
+    glm::mat4 pose = poseIn(target);
+    float tolerance = s_reprojectionTolerance * target->meanEdgeLength();
+    float tolerance2 = tolerance * tolerance;
 
-    glm::vec3 curPosition;;
-    glm::vec3 curTargetPosition;
-    int bestIndex;
-    glm::vec3 diff;
-    float bestScore;
-    float curScore;
+    long u;
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (u = 0; u < (long) m_uniquePositionVector.size(); u++)
+    {
+        glm::vec3 query(pose * glm::vec4(m_uniquePositionVector[u], 1.0f));
+        glm::vec3 moved = query - m_projectionQueryVector[u];
+        if (glm::dot(moved, moved) <= tolerance2)
+            continue;
+        m_projectionQueryVector[u] = query;
+        projectPoint(search, query, m_projectionHitVector[u], m_projectionPointVector[u],
+                     m_projectionPointTextureVector[u]);
+    }
 
-    m_projectionPositionVector = std::vector<glm::vec3>(m_numVertices);
-    m_projectionTextureVector = std::vector<glm::vec2>(m_numVertices);
+    m_projectionPose = pose;
+    m_projectionEpsilon = s_projectionEpsilon;
+    uploadProjectionBuffers();
+    return true;
+}
 
-    // unordered_set<int> used;
+// Searches again, exactly, from the query of every unique position
+void Model::reportProjectionError()
+{
+    if (!m_projected || projecting())
+        return;
 
-    int i = 0, j = 0;
-    #pragma omp parallel for private(curPosition, curTargetPosition, bestIndex, diff, bestScore, curScore, j)
-    for (i = 0; i < m_numVertices; i++)
+    ProjectionTarget search;
+    if (!findProjectionTarget(m_projectionTarget, m_projectionSurface, 0.0f, search))
+        return;
+
+    double sum = 0.0, maxError = 0.0, maxRatio = 0.0;
+    long missed = 0;
+    unsigned long numPositions = m_uniquePositionVector.size();
+    long u;
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+:sum, missed) reduction(max:maxError, maxRatio)
+    for (u = 0; u < (long) numPositions; u++)
     {
-        curPosition = m_positionVector[i];
-        bestScore = FLT_MAX;
-        for (j = 0; j < numTargetPositions; j++)
+        const glm::vec3 &query = m_projectionQueryVector[u];
+        int hit = -1;
+        glm::vec3 point;
+        glm::vec2 texture;
+        projectPoint(search, query, hit, point, texture);
+        double exact = glm::distance(query, point);
+        double found = glm::distance(query, m_projectionPointVector[u]);
+        double error = std::max(found - exact, 0.0);
+        sum += error;
+        maxError = std::max(maxError, error);
+        if (exact > 0.0)
+            maxRatio = std::max(maxRatio, error / exact);
+        if (hit != m_projectionHitVector[u])
+            missed++;
+    }
+    fprintf(stderr, "Projection error: mean %g, max %g (%.2f%% further than the closest at worst), "
+            "%ld of %lu positions off their closest %s\n",
+            sum / numPositions, maxError, 100.0 * maxRatio, missed, numPositions,
+            m_projectionSurface ? "triangle" : "vertex");
+}
+
+// Resets the job state and records what to project from and onto, on the
+// GL thread. Fetching the target's structure here may take the time to build
+// it, the first time a mesh is a target; later runs map it from its file.
+// False if there is nothing to project onto.
+bool Model::beginProjection(Model *target, float epsilon)
+{
+    m_projectionCancel = false;
+    m_projectionDone = false;
+    m_projectionProgress = 0;
+    m_projectionReported = 0;
+    m_pendingTarget = target;
+    m_pendingSurface = s_surfaceProjection;
+    m_pendingEpsilon = epsilon;
+    m_pendingPose = poseIn(target);
+    m_pendingTexture = target->texture();
+    findUniquePositions();
+
+    ProjectionTarget search;
+    bool found = findProjectionTarget(target, m_pendingSurface, epsilon, search);
+    m_pendingBVH = search.bvh;
+    m_pendingIndex = search.tree;
+    return found;
+}
+
+// Fills the pending projection vectors; safe to run off the GL thread, as
+// it only reads the structure beginProjection() fetched and the target's
+// vectors. Returns false if there is nothing to project onto or it was
+// cancelled.
+bool Model::computeProjection(Model *target, int threads)
+{
+    ProjectionTarget search;
+    if (!useProjectionTarget(target, m_pendingBVH, m_pendingIndex, m_pendingEpsilon, search))
+        return false;
+
+    long numPositions = (long) m_uniquePositionVector.size();
+    m_pendingQueryVector = std::vector<glm::vec3>(numPositions);
+    m_pendingHitVector = std::vector<int>(numPositions);
+    m_pendingPointVector = std::vector<glm::vec3>(numPositions);
+    m_pendingPointTextureVector = std::vector<glm::vec2>(numPositions);
+    glm::mat4 pose = m_pendingPose;
+
+    // blocks of positions, so progress and cancellation are checked often
+    // without touching the atomics for every position
+    const long BLOCK = 1024;
+    long numBlocks = (numPositions + BLOCK - 1) / BLOCK;
+    long block;
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(threads)
+    for (block = 0; block < numBlocks; block++)
+    {
+        if (m_projectionCancel)
+            continue;
+        long end = std::min((block + 1) * BLOCK, numPositions);
+        for (long u = block * BLOCK; u < end; u++)
         {
-            // if (used.find(j) != used.end())
-            //     continue;
-            curScore = correspondenceScore(curPosition, (*targetPositions)[j]);
-            if (curScore < bestScore)
-            {
-                bestScore = curScore;
-                bestIndex = j;
-            }
+            glm::vec3 query(pose * glm::vec4(m_uniquePositionVector[u], 1.0f));
+            int hit = -1;
+            projectPoint(search, query, hit, m_pendingPointVector[u], m_pendingPointTextureVector[u]);
+            m_pendingQueryVector[u] = query;
+            m_pendingHitVector[u] = hit;
         }
-        m_projectionPositionVector[i] = (*targetPositions)[bestIndex];
-        m_projectionTextureVector[i] = (*targetTextures)[bestIndex];
-        // used.insert(bestIndex);
+        m_projectionProgress += (unsigned long) (end - block * BLOCK);
+    }
+
+    if (m_projectionCancel)
+    {
+        m_pendingQueryVector.clear();
+        m_pendingHitVector.clear();
+        m_pendingPointVector.clear();
+        m_pendingPointTextureVector.clear();
+        return false;
+    }
+    return true;
+}
+
+// Moves the pending projection into place and uploads it; GL thread only
+void Model::uploadProjection()
+{
+    m_projectionQueryVector.swap(m_pendingQueryVector);
+    m_projectionHitVector.swap(m_pendingHitVector);
+    m_projectionPointVector.swap(m_pendingPointVector);
+    m_projectionPointTextureVector.swap(m_pendingPointTextureVector);
+    m_pendingQueryVector.clear();
+    m_pendingHitVector.clear();
+    m_pendingPointVector.clear();
+    m_pendingPointTextureVector.clear();
+    m_projectionTexture = m_pendingTexture;
+    m_projectionTarget = m_pendingTarget;
+    m_projectionSurface = m_pendingSurface;
+    m_projectionEpsilon = m_pendingEpsilon;
+    m_projectionPose = m_pendingPose;
+    uploadProjectionBuffers();
+}
+
+// Takes the projected points back into this model's space, where they are
+// drawn, scatters them and their texture coordinates to the vertices at each
+// position, and uploads them
+void Model::uploadProjectionBuffers()
+{
+    glm::mat4 toModel = glm::inverse(m_projectionPose);
+    m_projectionPositionVector.resize(m_numVertices);
+    m_projectionTextureVector.resize(m_numVertices);
+    long i;
+    #pragma omp parallel for
+    for (i = 0; i < (long) m_numVertices; i++)
+    {
+        unsigned int u = m_uniqueIndexVector[i];
+        m_projectionPositionVector[i] = glm::vec3(toModel * glm::vec4(m_projectionPointVector[u], 1.0f));
+        m_projectionTextureVector[i] = m_projectionPointTextureVector[u];
     }
-    m_projectionTexture = target->texture();
 
-    glGenBuffers(1, &m_projectionPositionVBO);
+    if (!m_projectionPositionVBO)
+        glGenBuffers(1, &m_projectionPositionVBO);
     glBindBuffer(GL_ARRAY_BUFFER, m_projectionPositionVBO);
     glBufferData(GL_ARRAY_BUFFER,
                  m_numVertices * sizeof(glm::vec3),
                  &m_projectionPositionVector[0],
                  GL_STATIC_DRAW);
 
-    glGenBuffers(1, &m_projectionTextureVBO);
+    if (!m_projectionTextureVBO)
+        glGenBuffers(1, &m_projectionTextureVBO);
     glBindBuffer(GL_ARRAY_BUFFER, m_projectionTextureVBO);
     glBufferData(GL_ARRAY_BUFFER,
                  m_numVertices * sizeof(glm::vec2),
@@ -359,7 +1115,6 @@ void Model::projectOnto(Model *target)
                  GL_STATIC_DRAW);
 
     m_projected = true;
-    fprintf(stderr, "DONE!\n");
 }
 
 void Model::adjustWeight(float amount)
@@ -399,11 +1154,71 @@ void Model::drawProjection(GLuint program) const
         setAttribute(program, "otherVertexTexture", 2, m_textureVBO);
 
     }
-    glDrawArrays(GL_TRIANGLES, 0, m_numVertices);
+    drawTriangles();
+}
+
+void Model::drawTriangles() const
+{
+    if (m_indexed)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+        glDrawElements(GL_TRIANGLES, (int) m_indexVector.size(), GL_UNSIGNED_INT, (void*)0);
+    }
+    else
+        glDrawArrays(GL_TRIANGLES, 0, (int) m_numVertices);
 }
 
 // Private functions
 
+// Moves values[v] to values[remap[v]]
+template <typename T>
+static void remapVector(std::vector<T> &values, const std::vector<unsigned int> &remap)
+{
+    if (values.empty())
+        return;
+    std::vector<T> result(values.size());
+    for (unsigned long v = 0; v < values.size(); v++)
+        result[remap[v]] = values[v];
+    values.swap(result);
+}
+
+// Reorders triangles for vertex cache reuse, then vertices by first use or
+// along a Morton curve
+void Model::optimizeIndices()
+{
+    if (!s_indexed)
+        return;
+
+    float before = meshACMR(m_indexVector, (unsigned int) m_numVertices);
+    optimizeVertexCache(m_indexVector, (unsigned int) m_numVertices);
+    float after = meshACMR(m_indexVector, (unsigned int) m_numVertices);
+    fprintf(stderr, "Vertex cache ACMR %.3f -> %.3f\n", before, after);
+
+    std::vector<unsigned int> remap;
+    if (s_mortonOrder)
+        remap = optimizeVertexLocality(m_indexVector, (const float *) &m_positionVector[0], (unsigned int) m_numVertices);
+    else
+        remap = optimizeVertexFetch(m_indexVector, (unsigned int) m_numVertices);
+    remapVector(m_positionVector, remap);
+    remapVector(m_colorVector, remap);
+    remapVector(m_textureVector, remap);
+    remapVector(m_normalVector, remap);
+}
+
+void Model::uploadIndices()
+{
+    m_indexed = s_indexed;
+    if (!m_indexed)
+        return;
+
+    fprintf(stderr, "Indexed %lu corners into %lu vertices\n", m_indexVector.size(), m_numVertices);
+    glGenBuffers(1, &m_indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 m_indexVector.size() * sizeof(unsigned int),
+                 &m_indexVector[0],
+                 GL_STATIC_DRAW);
+}
 
 
 void Model::setAttribute(GLuint program, const GLchar *name, unsigned int size, GLuint vbo) const
@@ -455,6 +1270,7 @@ vector<glm::vec3> cube(glm::vec3 center, GLfloat size)
 
 Model::Marker::Marker(glm::vec3 position)
 {
+    m_center = position;
     std::vector<glm::vec3> positionBuffer = cube(position, 0.002f);
     std::vector<glm::vec3> m_colorVector;
     glm::vec3 color(1.0f, 1.0f, 1.0f);
@@ -475,4 +1291,12 @@ Model::Marker::Marker(glm::vec3 position)
                  GL_STATIC_DRAW);
 }
 
+// Redraws the cube around shown, leaving the center the warp is fitted at
+void Model::Marker::place(glm::vec3 shown)
+{
+    std::vector<glm::vec3> positionBuffer = cube(shown, 0.002f);
+    glBindBuffer(GL_ARRAY_BUFFER, m_positionVBO);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, positionBuffer.size() * sizeof(glm::vec3), &positionBuffer[0]);
+}
+
 
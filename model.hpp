@@ -2,28 +2,75 @@
 #define MODEL_HPP
 
 #include <stdio.h>
+#include <stdint.h>
 #include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
 #include <glm/glm.hpp>
 #include <GLFW/glfw3.h>
 
 #include "globals.hpp"
+#include "spatialindex.hpp"
+#include "bvh.hpp"
+#include "incrementaltps.hpp"
 
 class Model
 {
 public:
     Model();
     Model(const char *path, glm::vec3 position, const char *texturePath = (char*) 0);
-    ~Model() {}
+    ~Model();
     
     int loadColorOBJ(const char *path);
     int loadTextureOBJ(const char *objPath, const char *texturePath);
 
+    // threads used to parse OBJ files: 0 = all cores, 1 = serial
+    static void setLoadThreads(int threads) { s_loadThreads = threads; }
+    // weld corners into shared vertices drawn by index (default), or keep a triangle soup
+    static void setIndexed(bool indexed) { s_indexed = indexed; }
+    // number the vertices of indexed models along a Morton curve rather than
+    // in drawing order, so per-vertex passes such as projection run in
+    // spatially coherent order
+    static void setMortonOrder(bool morton) { s_mortonOrder = morton; }
+    // backend for nearest neighbour queries against models, k-d tree by default
+    static void setSpatialIndex(SpatialIndexType type) { s_spatialIndex = type; }
+    static SpatialIndexType spatialIndex() { return s_spatialIndex; }
+    // project onto the closest point of the target surface (default), or snap to its nearest vertex
+    static void setSurfaceProjection(bool surface) { s_surfaceProjection = surface; }
+    static bool surfaceProjection() { return s_surfaceProjection; }
+    // how far, as a fraction of the target's mean edge length, a vertex may
+    // move before reproject() searches for it again; 0 = whenever it moves
+    static void setReprojectionTolerance(float tolerance) { s_reprojectionTolerance = tolerance; }
+    // let projectOnto() and reproject() settle for matches up to 1 + epsilon
+    // times further than the closest, for quick previews; 0 = exact (default).
+    // startProjection() is always exact.
+    static void setProjectionEpsilon(float epsilon) { s_projectionEpsilon = epsilon; }
+    static float projectionEpsilon() { return s_projectionEpsilon; }
+    // report the error of every projectOnto() against an exact search
+    static void setCheckProjection(bool check) { s_checkProjection = check; }
+
     unsigned long numVertices() { return m_numVertices; }
     glm::mat4 model() const;
+    void setPose(const glm::mat4 &pose);
     void setMarker(glm::vec3 position);
     void undoMarker();
     void drawMarkers(GLuint program) const;
+    // warps the drawn mesh by a thin plate spline taking this model's markers
+    // onto target's, paired in the order they were placed. Markers placed or
+    // undone since the last call update the fit in O(p^2) rather than
+    // refitting it; the vertices are then warped on a worker thread, and a
+    // later call uploads the blocks of them that changed. Call it every
+    // frame from the GL thread. Only what is drawn moves: projection and
+    // alignment still use the model as loaded. Markers follow the warped
+    // mesh, drawn where their points are shown, while the fit keeps them
+    // where they were placed on the model as loaded. True if the mesh was
+    // redrawn.
+    bool warpToMarkers(Model *target);
+    void clearWarp();
+    bool warped() const { return m_warped; }
     void drawProjection(GLuint program) const;
+    void drawTriangles() const;
     
     // accessor functions
     glm::vec3 position() const { return m_position; }
@@ -33,6 +80,7 @@ public:
     GLuint textureVBO() const { return m_textureVBO; }
     GLuint texture() const { return m_texture; }
     bool textured() const { return m_textured; }
+    bool indexed() const { return m_indexed; }
     unsigned long numMarkers() const { return m_markers.size(); }
     
     // mutator functions
@@ -46,15 +94,62 @@ public:
     bool hidden() const { return m_hidden; }
 
     void projectOnto(Model *target);
+    // asynchronous projectOnto(): start it, poll with updateProjection() on
+    // the GL thread each frame (true once the result is uploaded), or cancel it
+    bool startProjection(Model *target);
+    bool updateProjection();
+    void cancelProjection();
+    bool projecting() const { return m_projectionRunning; }
+    float projectionProgress() const;
+    // refreshes the projection after either model moved, starting each vertex
+    // from its previous match; cheap enough to call every frame
+    bool reproject(Model *target);
+    // prints how much further the projected points are than the closest ones
+    void reportProjectionError();
+    // metric is an ICPMetric from icp.hpp
+    void alignTo(Model *target, int metric);
     void adjustWeight(float amount);
     std::vector<glm::vec3> *positionVector() { return &m_positionVector; }
     std::vector<glm::vec2> *textureVector() { return &m_textureVector; }
+    std::vector<unsigned int> *indexVector() { return &m_indexVector; }
+    const SpatialIndex &positionIndex();
+    const TriangleBVH &surfaceBVH();
+    // vertex normals from the OBJ, or computed from the triangles if it had none
+    const std::vector<glm::vec3> &surfaceNormals();
+    float meanEdgeLength();
 
     
 private:
     // private functions
+    void optimizeIndices();
+    void uploadIndices();
+    uint64_t meshKey(bool withIndices) const;
+    std::string indexFilePath(const char *extension) const;
+    void findUniquePositions();
+    glm::mat4 poseIn(Model *target) const;
+    bool projectionCurrent(Model *target, float epsilon) const;
+    bool beginProjection(Model *target, float epsilon);
+    bool computeProjection(Model *target, int threads);
+    void uploadProjection();
+    void uploadProjectionBuffers();
+    void startWarp();
+    void computeWarp(const glm::vec3 *shown, int threads);
+    bool uploadWarp();
+    void placeMarkers();
     
     // private variables
+    static int s_loadThreads;
+    static bool s_indexed;
+    static bool s_mortonOrder;
+    static SpatialIndexType s_spatialIndex;
+    static bool s_surfaceProjection;
+    static float s_reprojectionTolerance;
+    static float s_projectionEpsilon;
+    static bool s_checkProjection;
+    // vertices per block that the warp re-uploads if any of them moved
+    static const unsigned long WARP_UPLOAD_BLOCK = 4096;
+
+    std::string m_path;     // the OBJ file, if loaded from one
     unsigned long m_numVertices = 0;
     GLuint m_positionVBO = 0;
     GLuint m_colorVBO = 0;
@@ -75,16 +170,99 @@ private:
     std::vector<glm::vec3> m_colorVector;
     std::vector<glm::vec2> m_textureVector;
     std::vector<glm::vec3> m_normalVector;
+
+    // with m_indexed, the vectors above hold unique vertices and every three
+    // entries of m_indexVector form a triangle; otherwise they are a triangle soup
+    bool m_indexed = false;
+    std::vector<unsigned int> m_indexVector;
+    GLuint m_indexBuffer = 0;
     bool m_hidden = false;
 
+    // spatial index over m_positionVector, built on first use as a projection
+    // target and rebuilt if the backend changes; both it and the BVH are
+    // saved next to the OBJ, keyed by a hash of the mesh, and mapped back
+    // from there by later runs
+    SpatialIndex *m_positionIndex = 0;
+    SpatialIndexType m_positionIndexType = SPATIAL_INDEX_KDTREE;
+    // triangle hierarchy over the same mesh, for projection onto the surface
+    TriangleBVH m_surfaceBVH;
+    float m_meanEdgeLength = 0.0f;
+
+    // distinct positions among the vertices, and the one each vertex is at;
+    // projection searches once per position rather than once per vertex,
+    // which a triangle soup repeats about six times
+    std::vector<glm::vec3> m_uniquePositionVector;
+    std::vector<unsigned int> m_uniqueIndexVector;
+
     bool m_projected = false;
-    std::vector<glm::vec3> m_projectionPositionVector;
+    // the projection is found in the target's model space, from this model
+    // placed by m_projectionPose; each unique position keeps the query it
+    // was found for, the target triangle (or vertex) it landed on, and the
+    // point and texture coordinate there, so reproject() can revisit only
+    // the positions that moved. They are scattered to the vertices to draw.
+    Model *m_projectionTarget = 0;
+    bool m_projectionSurface = true;
+    float m_projectionEpsilon = 0.0f;
+    glm::mat4 m_projectionPose;
+    std::vector<glm::vec3> m_projectionQueryVector;
+    std::vector<int> m_projectionHitVector;
+    std::vector<glm::vec3> m_projectionPointVector;
+    std::vector<glm::vec2> m_projectionPointTextureVector;
+    std::vector<glm::vec3> m_projectionPositionVector;     // per vertex, in this model's space
     GLuint m_projectionPositionVBO = 0;
-    std::vector<glm::vec2> m_projectionTextureVector;
+    std::vector<glm::vec2> m_projectionTextureVector;      // per vertex
     GLuint m_projectionTextureVBO = 0;
     GLuint m_projectionTexture = 0;
     float m_projectionWeight = 1.0;
 
+    // background projection; the worker fills the pending vectors and the
+    // GL thread swaps them in once m_projectionDone is set
+    std::thread m_projectionThread;
+    std::atomic<bool> m_projectionCancel{false};
+    std::atomic<bool> m_projectionDone{false};
+    std::atomic<unsigned long> m_projectionProgress{0};   // vertices projected so far
+    bool m_projectionRunning = false;
+    int m_projectionReported = 0;                          // last progress printed, in percent
+    double m_projectionStart = 0.0;
+    Model *m_pendingTarget = 0;
+    bool m_pendingSurface = true;
+    float m_pendingEpsilon = 0.0f;
+    glm::mat4 m_pendingPose;
+    // the target's structure to search, built or mapped by beginProjection()
+    const TriangleBVH *m_pendingBVH = 0;
+    const SpatialIndex *m_pendingIndex = 0;
+    std::vector<glm::vec3> m_pendingQueryVector;
+    std::vector<int> m_pendingHitVector;
+    std::vector<glm::vec3> m_pendingPointVector;
+    std::vector<glm::vec2> m_pendingPointTextureVector;
+    GLuint m_pendingTexture = 0;
+
+    // landmark warp of the drawn mesh; m_positionVBO holds the warped
+    // positions while m_warped is set. The worker warps with m_pendingWarp
+    // into the pending vectors, marking which blocks of vertices differ
+    // from those shown, and the GL thread uploads those blocks once
+    // m_warpDone is set. A fit that changes meanwhile waits in m_warpStale.
+    IncrementalTPS m_warpFit;
+    // each marker paired so far, and its landmark in m_warpFit; -1 for a
+    // marker left out as it coincides with an earlier one
+    std::vector<glm::vec3> m_warpMarkerVector;
+    std::vector<int> m_warpSlotVector;
+    std::vector<glm::vec3> m_warpedPositionVector;      // per vertex
+    bool m_warped = false;
+    bool m_warpStale = false;
+    std::thread m_warpThread;
+    std::atomic<bool> m_warpDone{false};
+    bool m_warpRunning = false;
+    double m_warpStart = 0.0;
+    unsigned int m_warpReported = 0;                    // landmarks at the last warp printed
+    TPSWarp m_pendingWarp;
+    std::vector<double> m_warpBuffer;                   // unique positions, x, y, z
+    std::vector<glm::vec3> m_pendingWarpedVector;
+    std::vector<unsigned char> m_warpDirty;             // per block of vertices
+    // the warped unique positions, which setMarker() snaps to
+    std::vector<glm::vec3> m_warpedUniqueVector;
+    std::vector<glm::vec3> m_pendingWarpedUniqueVector;
+
 
 
     class Marker
@@ -92,6 +270,8 @@ private:
     public:
         Marker(glm::vec3 position);
         ~Marker() {}
+        void place(glm::vec3 shown);
+        glm::vec3 center() const { return m_center; }
         unsigned long numVertices() const { return m_numVertices; }
         GLuint positionVBO() const { return m_positionVBO; }
         GLuint colorVBO() const { return m_colorVBO; }
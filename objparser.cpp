@@ -0,0 +1,647 @@
+#include "objparser.hpp"
+#include <stdlib.h>
+#include <algorithm>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+bool MappedFile::open(const char *path)
+{
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    m_fd = fd;
+    m_size = (size_t) st.st_size;
+    if (m_size == 0)
+    {
+        m_data = "";
+        return true;
+    }
+
+    void *data = mmap(0, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        ::close(fd);
+        m_fd = -1;
+        m_size = 0;
+        return false;
+    }
+    m_data = (const char *) data;
+    madvise(data, m_size, MADV_SEQUENTIAL);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_fd < 0)
+        return;
+    if (m_size)
+        munmap((void *) m_data, m_size);
+    ::close(m_fd);
+    m_fd = -1;
+    m_data = 0;
+    m_size = 0;
+}
+
+
+
+static inline bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline bool isDigit(char c)
+{
+    return (unsigned) (c - '0') < 10u;
+}
+
+static inline const char *skipBlanks(const char *p, const char *end)
+{
+    while (p < end && isBlank(*p))
+        p++;
+    return p;
+}
+
+bool objParseInt(const char *&p, const char *end, int &value)
+{
+    const char *s = skipBlanks(p, end);
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+        negative = (*s++ == '-');
+    if (s == end || !isDigit(*s))
+        return false;
+
+    int result = 0;
+    while (s < end && isDigit(*s))
+        result = result * 10 + (*s++ - '0');
+
+    value = negative ? -result : result;
+    p = s;
+    return true;
+}
+
+bool objParseFloat(const char *&p, const char *end, float &value)
+{
+    static const double powersOf10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char *start = skipBlanks(p, end);
+    const char *s = start;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+        negative = (*s++ == '-');
+
+    // up to 15 significant digits fit exactly in a double's mantissa
+    unsigned long long mantissa = 0;
+    int significantDigits = 0;
+    int exponent = 0;
+    bool anyDigits = false;
+
+    while (s < end && isDigit(*s))
+    {
+        anyDigits = true;
+        if (mantissa || *s != '0')
+        {
+            if (significantDigits < 19)
+                mantissa = mantissa * 10 + (*s - '0');
+            else
+                exponent++;
+            significantDigits++;
+        }
+        s++;
+    }
+    if (s < end && *s == '.')
+    {
+        s++;
+        while (s < end && isDigit(*s))
+        {
+            anyDigits = true;
+            if (mantissa || *s != '0')
+            {
+                if (significantDigits < 19)
+                {
+                    mantissa = mantissa * 10 + (*s - '0');
+                    exponent--;
+                }
+                significantDigits++;
+            }
+            else
+                exponent--;
+            s++;
+        }
+    }
+    if (!anyDigits)
+        return false;
+
+    if (s < end && (*s == 'e' || *s == 'E'))
+    {
+        const char *e = s + 1;
+        int exponentValue;
+        if (e < end && (isDigit(*e) || ((*e == '-' || *e == '+') && e + 1 < end && isDigit(e[1]))))
+        {
+            objParseInt(e, end, exponentValue);
+            exponent += exponentValue;
+            s = e;
+        }
+    }
+
+    double result;
+    if (significantDigits <= 15 && exponent >= -22 && exponent <= 22)
+    {
+        result = (double) mantissa;
+        if (exponent < 0)
+            result /= powersOf10[-exponent];
+        else
+            result *= powersOf10[exponent];
+        if (negative)
+            result = -result;
+    }
+    else
+    {
+        // rare long or extreme numbers: defer to strtod on a bounded stack copy
+        char buffer[64];
+        size_t length = (size_t) (s - start);
+        if (length >= sizeof(buffer))
+            length = sizeof(buffer) - 1;
+        memcpy(buffer, start, length);
+        buffer[length] = '\0';
+        result = strtod(buffer, 0);
+    }
+
+    value = (float) result;
+    p = s;
+    return true;
+}
+
+// Parses "v", "v/vt", "v//vn" or "v/vt/vn".
+static bool parseIndexTuple(const char *&p, const char *end, ObjIndexTuple &tuple)
+{
+    tuple.v = tuple.vt = tuple.vn = 0;
+    if (!objParseInt(p, end, tuple.v))
+        return false;
+    if (p < end && *p == '/')
+    {
+        p++;
+        if (p < end && *p != '/')
+            objParseInt(p, end, tuple.vt);
+        if (p < end && *p == '/')
+        {
+            p++;
+            objParseInt(p, end, tuple.vn);
+        }
+    }
+    return true;
+}
+
+bool ObjReader::next()
+{
+    if (m_next >= m_end)
+        return false;
+
+    m_lineBegin = m_next;
+    const char *newline = (const char *) memchr(m_next, '\n', m_end - m_next);
+    m_lineEnd = newline ? newline : m_end;
+    m_next = newline ? newline + 1 : m_end;
+
+    const char *end = m_lineEnd;
+    if (end > m_lineBegin && end[-1] == '\r')
+        end--;
+
+    const char *p = skipBlanks(m_lineBegin, end);
+    m_label = p;
+    while (p < end && !isBlank(*p))
+        p++;
+    m_labelLength = (int) (p - m_label);
+
+    m_type = OBJ_OTHER;
+    m_numValues = 0;
+    m_numCorners = 0;
+
+    if (m_labelLength == 1 && m_label[0] == 'v')
+        m_type = OBJ_VERTEX;
+    else if (m_labelLength == 2 && m_label[0] == 'v' && m_label[1] == 't')
+        m_type = OBJ_TEXCOORD;
+    else if (m_labelLength == 2 && m_label[0] == 'v' && m_label[1] == 'n')
+        m_type = OBJ_NORMAL;
+    else if (m_labelLength == 1 && m_label[0] == 'f')
+        m_type = OBJ_FACE;
+    else
+        return true;
+
+    if (m_type == OBJ_FACE)
+    {
+        ObjIndexTuple tuple;
+        while (m_numCorners < MAX_CORNERS && parseIndexTuple(p, end, tuple))
+            m_corners[m_numCorners++] = tuple;
+    }
+    else
+    {
+        while (m_numValues < MAX_VALUES && objParseFloat(p, end, m_values[m_numValues]))
+            m_numValues++;
+    }
+    return true;
+}
+
+
+
+// Indices inside a chunk: 0-based global for positive OBJ indices, or a
+// chunk-relative position offset by RELATIVE_INDEX for negative ones,
+// fixed up once the chunk's place in the whole file is known.
+static const int ABSENT_INDEX = INT_MIN;
+static const int RELATIVE_INDEX = INT_MIN / 2;
+
+static inline int chunkIndex(int index, size_t localCount)
+{
+    if (index > 0)
+        return index - 1;
+    if (index == 0)
+        return ABSENT_INDEX;
+    return RELATIVE_INDEX + (int) localCount + index;
+}
+
+static inline int mergedIndex(int index, size_t offset)
+{
+    if (index >= 0)
+        return index;
+    if (index == ABSENT_INDEX)
+        return -1;
+    return (int) offset + (index - RELATIVE_INDEX);
+}
+
+static void parseChunk(const char *begin, const char *end, ObjData &chunk, bool vertexColors)
+{
+    ObjReader reader(begin, end);
+    while (reader.next())
+    {
+        switch (reader.type())
+        {
+            case (ObjReader::OBJ_VERTEX):
+            {
+                for (int i = 0; i < 3; i++)
+                    chunk.positions.push_back(i < reader.numValues() ? reader.value(i) : 0.0f);
+                if (vertexColors)
+                    for (int i = 3; i < 6; i++)
+                        chunk.colors.push_back(i < reader.numValues() ? reader.value(i) : 0.0f);
+                break;
+            }
+            case (ObjReader::OBJ_TEXCOORD):
+            {
+                for (int i = 0; i < 2; i++)
+                    chunk.texcoords.push_back(i < reader.numValues() ? reader.value(i) : 0.0f);
+                break;
+            }
+            case (ObjReader::OBJ_NORMAL):
+            {
+                for (int i = 0; i < 3; i++)
+                    chunk.normals.push_back(i < reader.numValues() ? reader.value(i) : 0.0f);
+                break;
+            }
+            case (ObjReader::OBJ_FACE):
+            {
+                // triangulate polygons as a fan around the first corner
+                for (int k = 1; k + 1 < reader.numCorners(); k++)
+                {
+                    int corners[3] = { 0, k, k + 1 };
+                    for (int i = 0; i < 3; i++)
+                    {
+                        const ObjIndexTuple &raw = reader.corner(corners[i]);
+                        ObjIndexTuple tuple;
+                        tuple.v = chunkIndex(raw.v, chunk.positions.size() / 3);
+                        tuple.vt = chunkIndex(raw.vt, chunk.texcoords.size() / 2);
+                        tuple.vn = chunkIndex(raw.vn, chunk.normals.size() / 3);
+                        chunk.corners.push_back(tuple);
+                    }
+                }
+                break;
+            }
+            default:
+            {
+                if (!chunk.unsupported && reader.labelLength() > 1 && reader.label()[0] == 'v')
+                    chunk.unsupported = reader.label()[1];
+                break;
+            }
+        }
+    }
+}
+
+void objParse(const char *begin, const char *end, ObjData &data, bool vertexColors, int numThreads)
+{
+    data = ObjData();
+
+#ifdef _OPENMP
+    if (numThreads <= 0)
+        numThreads = omp_get_max_threads();
+#else
+    numThreads = 1;
+#endif
+
+    // small files are not worth the thread start-up and merge
+    const size_t MIN_CHUNK_SIZE = 1 << 20;
+    size_t size = (size_t) (end - begin);
+    int numChunks = numThreads;
+    if (size / MIN_CHUNK_SIZE < (size_t) numChunks)
+        numChunks = (int) (size / MIN_CHUNK_SIZE);
+    if (numChunks < 1)
+        numChunks = 1;
+
+    // split at line boundaries
+    std::vector<const char *> bounds(numChunks + 1);
+    bounds[0] = begin;
+    bounds[numChunks] = end;
+    for (int c = 1; c < numChunks; c++)
+    {
+        const char *p = begin + size * c / numChunks;
+        if (p < bounds[c - 1])
+            p = bounds[c - 1];
+        const char *newline = (const char *) memchr(p, '\n', end - p);
+        bounds[c] = newline ? newline + 1 : end;
+    }
+
+    if (numChunks == 1)
+    {
+        parseChunk(begin, end, data, vertexColors);
+        for (size_t i = 0; i < data.corners.size(); i++)
+        {
+            ObjIndexTuple &tuple = data.corners[i];
+            tuple.v = mergedIndex(tuple.v, 0);
+            tuple.vt = mergedIndex(tuple.vt, 0);
+            tuple.vn = mergedIndex(tuple.vn, 0);
+        }
+        return;
+    }
+
+    std::vector<ObjData> chunks(numChunks);
+    int c;
+    #pragma omp parallel for schedule(static, 1) num_threads(numThreads)
+    for (c = 0; c < numChunks; c++)
+        parseChunk(bounds[c], bounds[c + 1], chunks[c], vertexColors);
+
+    // prefix sums of the per-chunk counts give each chunk's output offsets
+    std::vector<size_t> positionOffset(numChunks + 1, 0), colorOffset(numChunks + 1, 0);
+    std::vector<size_t> texcoordOffset(numChunks + 1, 0), normalOffset(numChunks + 1, 0);
+    std::vector<size_t> cornerOffset(numChunks + 1, 0);
+    for (c = 0; c < numChunks; c++)
+    {
+        positionOffset[c + 1] = positionOffset[c] + chunks[c].positions.size();
+        colorOffset[c + 1] = colorOffset[c] + chunks[c].colors.size();
+        texcoordOffset[c + 1] = texcoordOffset[c] + chunks[c].texcoords.size();
+        normalOffset[c + 1] = normalOffset[c] + chunks[c].normals.size();
+        cornerOffset[c + 1] = cornerOffset[c] + chunks[c].corners.size();
+        if (!data.unsupported)
+            data.unsupported = chunks[c].unsupported;
+    }
+
+    data.positions.resize(positionOffset[numChunks]);
+    data.colors.resize(colorOffset[numChunks]);
+    data.texcoords.resize(texcoordOffset[numChunks]);
+    data.normals.resize(normalOffset[numChunks]);
+    data.corners.resize(cornerOffset[numChunks]);
+
+    #pragma omp parallel for schedule(static, 1) num_threads(numThreads)
+    for (c = 0; c < numChunks; c++)
+    {
+        ObjData &chunk = chunks[c];
+        std::copy(chunk.positions.begin(), chunk.positions.end(), data.positions.begin() + positionOffset[c]);
+        std::copy(chunk.colors.begin(), chunk.colors.end(), data.colors.begin() + colorOffset[c]);
+        std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), data.texcoords.begin() + texcoordOffset[c]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(), data.normals.begin() + normalOffset[c]);
+
+        // relative indices count back from this chunk's place in the whole file
+        ObjIndexTuple *out = data.corners.data() + cornerOffset[c];
+        for (size_t i = 0; i < chunk.corners.size(); i++)
+        {
+            out[i].v = mergedIndex(chunk.corners[i].v, positionOffset[c] / 3);
+            out[i].vt = mergedIndex(chunk.corners[i].vt, texcoordOffset[c] / 2);
+            out[i].vn = mergedIndex(chunk.corners[i].vn, normalOffset[c] / 3);
+        }
+    }
+}
+
+
+
+char *objFormatDouble(char *p, double value)
+{
+    static const double powersOf10[] = { 1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+    // 10^(5 - exponent): brings the leading 6 digits in front of the point
+    static const double digitScale[] = { 1e9, 1e8, 1e7, 1e6, 1e5, 1e4, 1e3, 1e2, 1e1, 1e0 };
+
+    double magnitude = value < 0.0 ? -value : value;
+
+    // fixed notation with 6 significant digits; anything else (exponent
+    // notation, zero, inf, nan) goes through snprintf
+    if (!(magnitude >= 1e-4 && magnitude < 1e6))
+        return p + snprintf(p, 32, "%g", value);
+
+    int exponent = -4;
+    while (magnitude >= powersOf10[exponent + 5])
+        exponent++;
+
+    double scaled = magnitude * digitScale[exponent + 4];
+    long long digits = (long long) scaled;
+    double remainder = scaled - (double) digits;
+    // printf rounds ties to even on the exact binary value; leave those to it
+    if (remainder == 0.5)
+        return p + snprintf(p, 32, "%g", value);
+    if (remainder > 0.5)
+        digits++;
+    if (digits >= 1000000)
+    {
+        digits /= 10;
+        exponent++;
+        if (exponent >= 6)
+            return p + snprintf(p, 32, "%g", value);
+    }
+
+    char text[6];
+    for (int i = 5; i >= 0; i--)
+    {
+        text[i] = (char) ('0' + digits % 10);
+        digits /= 10;
+    }
+
+    if (value < 0.0)
+        *p++ = '-';
+
+    int fraction;   // digits of text after the decimal point
+    if (exponent >= 0)
+    {
+        for (int i = 0; i <= exponent; i++)
+            *p++ = text[i];
+        fraction = 5 - exponent;
+    }
+    else
+    {
+        *p++ = '0';
+        fraction = 6;
+    }
+
+    int last = 6;
+    while (last > 6 - fraction && text[last - 1] == '0')
+        last--;
+    if (last > 6 - fraction)
+    {
+        *p++ = '.';
+        for (int i = exponent + 1; i < 0; i++)
+            *p++ = '0';
+        for (int i = 6 - fraction; i < last; i++)
+            *p++ = text[i];
+    }
+    return p;
+}
+
+namespace
+{
+    // Per-thread state of objTransformStream, reused from block to block
+    struct StreamSlice
+    {
+        const char *begin;
+        const char *end;
+        std::vector<double> xyz;
+        std::vector<char> output;
+    };
+
+    void transformSlice(StreamSlice &slice, ObjVertexTransform transform, void *context)
+    {
+        slice.xyz.clear();
+        ObjReader reader(slice.begin, slice.end);
+        while (reader.next())
+        {
+            if (reader.type() != ObjReader::OBJ_VERTEX)
+                continue;
+            for (int i = 0; i < 3; i++)
+                slice.xyz.push_back(i < reader.numValues() ? reader.value(i) : 0.0);
+        }
+        if (!slice.xyz.empty())
+            transform(slice.xyz.data(), slice.xyz.size() / 3, context);
+
+        // every output line is at most as long as its input plus the
+        // reformatted vertex, so reserve once and write through a pointer
+        size_t lines = slice.xyz.size() / 3 + 1;
+        slice.output.resize((size_t) (slice.end - slice.begin) + lines * 100);
+        char *out = slice.output.data();
+        const double *v = slice.xyz.data();
+
+        reader = ObjReader(slice.begin, slice.end);
+        while (reader.next())
+        {
+            if (reader.type() == ObjReader::OBJ_VERTEX)
+            {
+                *out++ = 'v';
+                for (int i = 0; i < 3; i++)
+                {
+                    *out++ = ' ';
+                    out = objFormatDouble(out, *v++);
+                }
+            }
+            else
+            {
+                size_t length = (size_t) (reader.lineEnd() - reader.lineBegin());
+                memcpy(out, reader.lineBegin(), length);
+                out += length;
+            }
+            *out++ = '\n';
+        }
+        slice.output.resize((size_t) (out - slice.output.data()));
+    }
+}
+
+bool objTransformStream(FILE *in, FILE *out, ObjVertexTransform transform, void *context, int numThreads)
+{
+#ifdef _OPENMP
+    if (numThreads <= 0)
+        numThreads = omp_get_max_threads();
+#else
+    numThreads = 1;
+#endif
+
+    const size_t BLOCK_SIZE = 8 << 20;
+    std::vector<char> buffer(BLOCK_SIZE);
+    std::vector<StreamSlice> slices(numThreads);
+    size_t carried = 0;     // bytes of an unfinished line kept from the last block
+    bool eof = false;
+
+    while (!eof || carried)
+    {
+        // a single line longer than the block: grow the buffer
+        if (carried == buffer.size())
+            buffer.resize(2 * buffer.size());
+
+        size_t got = eof ? 0 : fread(buffer.data() + carried, 1, buffer.size() - carried, in);
+        if (got < buffer.size() - carried)
+        {
+            if (ferror(in))
+                return false;
+            eof = true;
+        }
+        size_t filled = carried + got;
+        if (filled == 0)
+            break;
+
+        // process whole lines only, unless this is the end of the input
+        size_t used = filled;
+        if (!eof)
+        {
+            const char *last = buffer.data() + filled;
+            while (last > buffer.data() && last[-1] != '\n')
+                last--;
+            used = (size_t) (last - buffer.data());
+            if (used == 0)
+            {
+                carried = filled;
+                continue;
+            }
+        }
+
+        // split the block at line boundaries, one slice per thread
+        const char *begin = buffer.data();
+        const char *end = begin + used;
+        for (int t = 0; t < numThreads; t++)
+        {
+            const char *p = t ? slices[t - 1].end : begin;
+            const char *q = begin + used * (t + 1) / numThreads;
+            if (q < p)
+                q = p;
+            if (t == numThreads - 1)
+                q = end;
+            else
+            {
+                const char *newline = (const char *) memchr(q, '\n', end - q);
+                q = newline ? newline + 1 : end;
+            }
+            slices[t].begin = p;
+            slices[t].end = q;
+        }
+
+        int t;
+        #pragma omp parallel for schedule(static, 1) num_threads(numThreads)
+        for (t = 0; t < numThreads; t++)
+            transformSlice(slices[t], transform, context);
+
+        for (t = 0; t < numThreads; t++)
+            if (!slices[t].output.empty() &&
+                fwrite(slices[t].output.data(), 1, slices[t].output.size(), out) != slices[t].output.size())
+                return false;
+
+        carried = filled - used;
+        memmove(buffer.data(), buffer.data() + used, carried);
+    }
+    return true;
+}
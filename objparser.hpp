@@ -0,0 +1,138 @@
+#ifndef OBJPARSER_HPP
+#define OBJPARSER_HPP
+
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+// Read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+    MappedFile() {}
+    MappedFile(const char *path) { open(path); }
+    ~MappedFile() { close(); }
+
+    bool open(const char *path);
+    void close();
+
+    bool isOpen() const { return m_fd >= 0; }
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+    const char *begin() const { return m_data; }
+    const char *end() const { return m_data + m_size; }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    int m_fd = -1;
+    const char *m_data = 0;
+    size_t m_size = 0;
+};
+
+// Hand-written number scanners. Each skips leading blanks, advances p past
+// the number on success and leaves p untouched on failure.
+bool objParseFloat(const char *&p, const char *end, float &value);
+bool objParseInt(const char *&p, const char *end, int &value);
+
+// One v/vt/vn index tuple of a face corner, as written in the file:
+// 1-based, negative for relative indices, 0 when the field is absent.
+struct ObjIndexTuple
+{
+    int v;
+    int vt;
+    int vn;
+};
+
+// Walks the records of an OBJ file in place, one line at a time, without
+// allocating. Values of the current record stay valid until the next call
+// to next().
+class ObjReader
+{
+public:
+    enum RecordType
+    {
+        OBJ_VERTEX,      // v x y z [r g b]
+        OBJ_TEXCOORD,    // vt u v [w]
+        OBJ_NORMAL,      // vn x y z
+        OBJ_FACE,        // f v[/vt][/vn] ...
+        OBJ_OTHER        // comments, blank lines, groups, materials, ...
+    };
+
+    static const int MAX_VALUES = 7;
+    static const int MAX_CORNERS = 32;
+
+    ObjReader(const char *begin, const char *end) : m_next(begin), m_end(end) {}
+
+    // Parses the next line; returns false at the end of the input.
+    bool next();
+
+    RecordType type() const { return m_type; }
+    const char *lineBegin() const { return m_lineBegin; }
+    const char *lineEnd() const { return m_lineEnd; }
+
+    // raw label of the line ("v", "vt", "usemtl", ...), not NUL terminated
+    const char *label() const { return m_label; }
+    int labelLength() const { return m_labelLength; }
+
+    int numValues() const { return m_numValues; }
+    float value(int i) const { return m_values[i]; }
+
+    int numCorners() const { return m_numCorners; }
+    const ObjIndexTuple &corner(int i) const { return m_corners[i]; }
+
+private:
+    const char *m_next;
+    const char *m_end;
+    const char *m_lineBegin = 0;
+    const char *m_lineEnd = 0;
+    const char *m_label = 0;
+    int m_labelLength = 0;
+
+    RecordType m_type = OBJ_OTHER;
+    int m_numValues = 0;
+    float m_values[MAX_VALUES];
+    int m_numCorners = 0;
+    ObjIndexTuple m_corners[MAX_CORNERS];
+};
+
+// Whole-file parse result. Vertex attributes are packed floats (3 per
+// position, color and normal, 2 per texture coordinate). Faces are
+// triangulated into corners, 3 per triangle, whose indices are resolved to
+// 0-based values, or -1 when a field is absent.
+struct ObjData
+{
+    std::vector<float> positions;
+    std::vector<float> colors;
+    std::vector<float> texcoords;
+    std::vector<float> normals;
+    std::vector<ObjIndexTuple> corners;
+    char unsupported = 0;   // second letter of the first unsupported "v?" record
+};
+
+// Parses the OBJ text in [begin, end). The text is split at line boundaries
+// into chunks that are parsed on up to numThreads threads (0 = all cores,
+// 1 = serial) and merged in file order, so the result does not depend on
+// the thread count. Colors are read only when vertexColors is set.
+void objParse(const char *begin, const char *end, ObjData &data,
+              bool vertexColors = false, int numThreads = 0);
+
+// Writes value the way printf("%g") and the default ostream format do, and
+// returns the end of the text. p needs room for 32 characters.
+char *objFormatDouble(char *p, double value);
+
+// Batch vertex transform for objTransformStream: xyz holds count vertices as
+// consecutive x, y, z values (the layout of an Eigen::Matrix3Xd), and is
+// updated in place. Called concurrently from several threads.
+typedef void (*ObjVertexTransform)(double *xyz, size_t count, void *context);
+
+// Copies OBJ text from in to out, replacing each "v" record by "v x y z" with
+// the transformed position. The input is read in fixed-size blocks whose
+// lines are split across threads; each thread parses, transforms and formats
+// its share into its own buffer, and the buffers are written in order, so
+// memory stays bounded however large the file is.
+bool objTransformStream(FILE *in, FILE *out, ObjVertexTransform transform, void *context,
+                        int numThreads = 0);
+
+#endif
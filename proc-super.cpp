@@ -2,30 +2,43 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <string>
+#include <cstdio>
+#include <omp.h>
 
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/quaternion.hpp>
 
 #include "Kabsch.hpp"
+#include "objparser.hpp"
 
 using namespace std;
 
 
 Eigen::Matrix3Xd loadLandmarks(const char *filename);
+void transformVertices(double *xyz, size_t count, void *context);
+int runBatch(const char *manifestPath, const char *refLandmarkPath);
 
 int main(int argc, char *argv[])
 {
+    if (argc == 4 && string(argv[1]) == "--batch")
+        return runBatch(argv[2], argv[3]);
+
     if (argc < 4)
     {
         cerr << "Usage: ./proc <face data> <landmark data> <reference landmark data>" << endl;
+        cerr << "       ./proc --batch <manifest> <reference landmark data>" << endl;
+        cerr << "Each manifest line is: <face data> <landmark data> [<output face data>]" << endl;
         return -1;
     }
 
-    ifstream infile(argv[1]);
-    string line, label;
-    
-    
+    FILE *infile = fopen(argv[1], "rb");
+    if (!infile)
+    {
+        cerr << "Could not open " << argv[1] << endl;
+        return -1;
+    }
     
     Eigen::Matrix3Xd landmarks = loadLandmarks(argv[2]);
     Eigen::Matrix3Xd refLandmarks = loadLandmarks(argv[3]);
@@ -37,25 +50,19 @@ int main(int argc, char *argv[])
     cerr << A(2,0) << " " << A(2,1) << " " << A(2,2) << " " << A(2,3) << endl;
     cerr << A(3,0) << " " << A(3,1) << " " << A(3,2) << " " << A(3,3) << endl;
 
-    // vertex list
-    float v0, v1, v2;
-    
-    while (getline(infile, line))
+    // the vertex lines go out in large per-thread blocks, so no stream
+    // buffering or per-line flushing on our side
+    cout.flush();
+    setvbuf(stdout, 0, _IOFBF, 1 << 20);
+    bool ok = objTransformStream(infile, stdout, transformVertices, &A);
+    fclose(infile);
+    fflush(stdout);
+    if (!ok)
     {
-        istringstream iss(line);
-        iss >> label;
-        if (label == "v")
-        {
-            iss >> v0 >> v1 >> v2;
-            Eigen::Vector4d v(v0, v1, v2, 1);
-            v = A*v;
-            cout << label << " " << v(0) << " " << v(1) << " " << v(2) << endl;
-        }
-        else
-        {
-            cout << line << endl;
-        }
+        cerr << "Error while rewriting " << argv[1] << endl;
+        return -1;
     }
+    return 0;
 }
 
 
@@ -87,3 +94,112 @@ Eigen::Matrix3Xd loadLandmarks(const char *filename)
 }
 
 
+// Applies the affine transform in context to a batch of vertices as one
+// 3xN block product
+void transformVertices(double *xyz, size_t count, void *context)
+{
+    const Eigen::Affine3d &A = *(const Eigen::Affine3d *) context;
+    Eigen::Map<Eigen::Matrix3Xd> vertices(xyz, 3, count);
+    vertices = (A.linear() * vertices).colwise() + A.translation();
+}
+
+
+struct BatchScan
+{
+    string facePath;
+    string landmarkPath;
+    string outputPath;
+    bool ok;
+    string error;
+    double residual;    // RMS distance of the aligned landmarks to the reference
+    double seconds;
+};
+
+// Aligns every scan listed in the manifest to the reference landmarks,
+// which are read once. Scans are spread over the threads, one scan each,
+// and the aligned OBJ goes to the output path (default <face data>.proc.obj).
+int runBatch(const char *manifestPath, const char *refLandmarkPath)
+{
+    ifstream manifest(manifestPath);
+    if (!manifest)
+    {
+        cerr << "Could not open " << manifestPath << endl;
+        return -1;
+    }
+
+    std::vector<BatchScan> scans;
+    string line;
+    while (getline(manifest, line))
+    {
+        istringstream iss(line);
+        BatchScan scan;
+        if (!(iss >> scan.facePath >> scan.landmarkPath) || scan.facePath[0] == '#')
+            continue;
+        if (!(iss >> scan.outputPath))
+            scan.outputPath = scan.facePath + ".proc.obj";
+        scan.ok = false;
+        scan.residual = 0.0;
+        scan.seconds = 0.0;
+        scans.push_back(scan);
+    }
+
+    Eigen::Matrix3Xd refLandmarks = loadLandmarks(refLandmarkPath);
+    double start = omp_get_wtime();
+
+    int i;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (i = 0; i < (int) scans.size(); i++)
+    {
+        BatchScan &scan = scans[i];
+        double scanStart = omp_get_wtime();
+        try
+        {
+            Eigen::Matrix3Xd landmarks = loadLandmarks(scan.landmarkPath.c_str());
+            Eigen::Affine3d A = Find3DAffineTransform(landmarks, refLandmarks);
+            scan.residual = sqrt(((A * landmarks) - refLandmarks).colwise().squaredNorm().mean());
+
+            FILE *in = fopen(scan.facePath.c_str(), "rb");
+            FILE *out = in ? fopen(scan.outputPath.c_str(), "wb") : 0;
+            if (!in)
+                scan.error = "could not open " + scan.facePath;
+            else if (!out)
+                scan.error = "could not write " + scan.outputPath;
+            else
+            {
+                // one thread per scan already keeps every core busy
+                scan.ok = objTransformStream(in, out, transformVertices, &A, 1);
+                if (!scan.ok)
+                    scan.error = "error while rewriting " + scan.facePath;
+            }
+            if (in)
+                fclose(in);
+            if (out && fclose(out) != 0 && scan.ok)
+            {
+                scan.ok = false;
+                scan.error = "could not write " + scan.outputPath;
+            }
+        }
+        catch (const char *message)
+        {
+            scan.error = message;
+        }
+        scan.seconds = omp_get_wtime() - scanStart;
+    }
+
+    int failed = 0;
+    for (i = 0; i < (int) scans.size(); i++)
+    {
+        const BatchScan &scan = scans[i];
+        if (scan.ok)
+            fprintf(stderr, "%s: residual %g, %.3f s -> %s\n", scan.facePath.c_str(), scan.residual,
+                    scan.seconds, scan.outputPath.c_str());
+        else
+        {
+            fprintf(stderr, "%s: FAILED (%s)\n", scan.facePath.c_str(), scan.error.c_str());
+            failed++;
+        }
+    }
+    fprintf(stderr, "Aligned %d of %d scans in %.3f s\n", (int) scans.size() - failed, (int) scans.size(),
+            omp_get_wtime() - start);
+    return failed ? -1 : 0;
+}
\ No newline at end of file
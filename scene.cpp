@@ -1,4 +1,5 @@
 #include "scene.hpp"
+#include "icp.hpp"
 
 
 Scene::Scene(Camera *camera, GLuint program)
@@ -13,6 +14,9 @@ Scene::Scene(Camera *camera, GLuint program)
 
 Scene::~Scene()
 {
+    // background projections read other models, so stop them all first
+    for (unsigned long i = 0; i < m_models.size(); i++)
+        m_models[i]->cancelProjection();
     while (!m_models.empty())
     {
         delete m_models.back();
@@ -84,6 +88,16 @@ void Scene::update()
     static bool vDown = false;
     static bool bDown = false;
     static bool pDown = false;
+    static bool iDown = false;
+    static bool uDown = false;
+    static bool kDown = false;
+    static bool nDown = false;
+    static bool cDown = false;
+    static bool lDown = false;
+    static bool oDown = false;
+    static bool rDown = false;
+    static bool gDown = false;
+    static bool tDown = false;
     
     if (!mouseDown && glfwGetMouseButton(m_window, GLFW_MOUSE_BUTTON_1) == GLFW_PRESS)
     {
@@ -141,12 +155,139 @@ void Scene::update()
     if (!pDown && glfwGetKey(m_window, GLFW_KEY_P) == GLFW_PRESS)
     {
         pDown = true;
+        // an approximate preview now, then the exact projection in the background
         if (m_models.size() > 1)
-            m_models[0]->projectOnto(m_models[1]);
+        {
+            if (Model::projectionEpsilon() > 0.0f)
+                m_models[0]->projectOnto(m_models[1]);
+            m_models[0]->startProjection(m_models[1]);
+        }
     }
     else if (glfwGetKey(m_window, GLFW_KEY_P) == GLFW_RELEASE)
         pDown = false;
 
+    // cancel a background projection
+    if (!cDown && glfwGetKey(m_window, GLFW_KEY_C) == GLFW_PRESS)
+    {
+        cDown = true;
+        m_models[0]->cancelProjection();
+    }
+    else if (glfwGetKey(m_window, GLFW_KEY_C) == GLFW_RELEASE)
+        cDown = false;
+
+    // hand finished background work to GL
+    for (unsigned long i = 0; i < m_models.size(); i++)
+        m_models[i]->updateProjection();
+
+    // align the first model to the second: I point-to-plane, U point-to-point;
+    // not while a projection reads the second model's search structures
+    bool busy = m_models[0]->projecting();
+    if (!iDown && glfwGetKey(m_window, GLFW_KEY_I) == GLFW_PRESS)
+    {
+        iDown = true;
+        if (m_models.size() > 1 && !busy)
+            m_models[0]->alignTo(m_models[1], ICP_POINT_TO_PLANE);
+    }
+    else if (glfwGetKey(m_window, GLFW_KEY_I) == GLFW_RELEASE)
+        iDown = false;
+
+    if (!uDown && glfwGetKey(m_window, GLFW_KEY_U) == GLFW_PRESS)
+    {
+        uDown = true;
+        if (m_models.size() > 1 && !busy)
+            m_models[0]->alignTo(m_models[1], ICP_POINT_TO_POINT);
+    }
+    else if (glfwGetKey(m_window, GLFW_KEY_U) == GLFW_RELEASE)
+        uDown = false;
+
+    // cycle the nearest neighbour backend used by projection and ICP
+    if (!kDown && glfwGetKey(m_window, GLFW_KEY_K) == GLFW_PRESS)
+    {
+        kDown = true;
+        SpatialIndexType type = (SpatialIndexType) ((Model::spatialIndex() + 1) % NUM_SPATIAL_INDEX_TYPES);
+        Model::setSpatialIndex(type);
+        fprintf(stderr, "Nearest neighbour search: %s\n", SpatialIndex::name(type));
+    }
+    else if (glfwGetKey(m_window, GLFW_KEY_K) == GLFW_RELEASE)
+        kDown = false;
+
+    // switch projection between the target surface and its nearest vertices
+    if (!nDown && glfwGetKey(m_window, GLFW_KEY_N) == GLFW_PRESS)
+    {
+        nDown = true;
+        Model::setSurfaceProjection(!Model::surfaceProjection());
+        fprintf(stderr, "Projection onto: %s\n", Model::surfaceProjection() ? "surface" : "nearest vertex");
+    }
+    else if (glfwGetKey(m_window, GLFW_KEY_N) == GLFW_RELEASE)
+        nDown = false;
+
+    // keep the projection up to date while the models are moved
+    if (!lDown && glfwGetKey(m_window, GLFW_KEY_L) == GLFW_PRESS)
+    {
+        lDown = true;
+        m_liveProjection = !m_liveProjection;
+        fprintf(stderr, "Live projection: %s\n", m_liveProjection ? "on" : "off");
+    }
+    else if (glfwGetKey(m_window, GLFW_KEY_L) == GLFW_RELEASE)
+        lDown = false;
+
+    if (m_liveProjection && m_models.size() > 1)
+        m_models[0]->reproject(m_models[1]);
+
+    // cycle how approximate previews and live projection may be
+    if (!oDown && glfwGetKey(m_window, GLFW_KEY_O) == GLFW_PRESS)
+    {
+        oDown = true;
+        const float epsilons[] = {0.0f, 0.1f, 0.5f, 2.0f};
+        const int numEpsilons = sizeof(epsilons) / sizeof(epsilons[0]);
+        int next = 0;
+        while (next < numEpsilons && epsilons[next] <= Model::projectionEpsilon())
+            next++;
+        Model::setProjectionEpsilon(epsilons[next % numEpsilons]);
+        fprintf(stderr, "Projection epsilon: %g\n", Model::projectionEpsilon());
+    }
+    else if (glfwGetKey(m_window, GLFW_KEY_O) == GLFW_RELEASE)
+        oDown = false;
+
+    // place markers on the next model: landmarks on the first and their
+    // targets on the second, in the same order
+    if (!gDown && glfwGetKey(m_window, GLFW_KEY_G) == GLFW_PRESS)
+    {
+        gDown = true;
+        unsigned long next = 0;
+        while (next < m_models.size() && m_models[next] != m_selectedModel)
+            next++;
+        selectModel((next + 1) % m_models.size());
+        fprintf(stderr, "Placing markers on model %lu\n", (next + 1) % m_models.size());
+    }
+    else if (glfwGetKey(m_window, GLFW_KEY_G) == GLFW_RELEASE)
+        gDown = false;
+
+    // warp the first model so its markers meet the second's, following
+    // markers as they are placed and undone
+    if (!tDown && glfwGetKey(m_window, GLFW_KEY_T) == GLFW_PRESS)
+    {
+        tDown = true;
+        m_liveWarp = !m_liveWarp;
+        if (!m_liveWarp)
+            m_models[0]->clearWarp();
+        fprintf(stderr, "Landmark warp: %s\n", m_liveWarp ? "on" : "off");
+    }
+    else if (glfwGetKey(m_window, GLFW_KEY_T) == GLFW_RELEASE)
+        tDown = false;
+
+    if (m_liveWarp && m_models.size() > 1)
+        m_models[0]->warpToMarkers(m_models[1]);
+
+    // compare the projection shown with an exact one
+    if (!rDown && glfwGetKey(m_window, GLFW_KEY_R) == GLFW_PRESS)
+    {
+        rDown = true;
+        m_models[0]->reportProjectionError();
+    }
+    else if (glfwGetKey(m_window, GLFW_KEY_R) == GLFW_RELEASE)
+        rDown = false;
+
 
 
 
@@ -188,7 +329,7 @@ void Scene::draw()
         }
 
         if (!model->hidden())
-            glDrawArrays(GL_TRIANGLES, 0, (int) model->numVertices());
+            model->drawTriangles();
         model->drawProjection(m_program);
         model->drawMarkers(m_program);
     }
@@ -54,6 +54,8 @@ private:
     Camera *m_camera;
     std::vector<Model*> m_models;
     Model *m_selectedModel;
+    bool m_liveProjection = false;     // reproject the first model onto the second every frame
+    bool m_liveWarp = false;           // warp the first model by the markers on both every frame
 
     /*class Correspondence
     {
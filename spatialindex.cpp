@@ -0,0 +1,32 @@
+#include "spatialindex.hpp"
+#include "kdtree.hpp"
+#include "bruteforce.hpp"
+#include "grid.hpp"
+
+SpatialIndex *SpatialIndex::create(SpatialIndexType type)
+{
+    switch (type)
+    {
+    case SPATIAL_INDEX_BRUTE_FORCE:
+        return new BruteForceIndex();
+    case SPATIAL_INDEX_GRID:
+        return new GridIndex();
+    case SPATIAL_INDEX_KDTREE:
+    default:
+        return new KDTree();
+    }
+}
+
+const char *SpatialIndex::name(SpatialIndexType type)
+{
+    switch (type)
+    {
+    case SPATIAL_INDEX_BRUTE_FORCE:
+        return "brute force";
+    case SPATIAL_INDEX_GRID:
+        return "uniform grid";
+    case SPATIAL_INDEX_KDTREE:
+    default:
+        return "k-d tree";
+    }
+}
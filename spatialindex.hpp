@@ -0,0 +1,62 @@
+#ifndef SPATIALINDEX_HPP
+#define SPATIALINDEX_HPP
+
+#include <stdint.h>
+#include <vector>
+#include <glm/glm.hpp>
+
+enum SpatialIndexType
+{
+    SPATIAL_INDEX_KDTREE,
+    SPATIAL_INDEX_BRUTE_FORCE,
+    SPATIAL_INDEX_GRID,
+    NUM_SPATIAL_INDEX_TYPES
+};
+
+// Nearest neighbour queries over a fixed set of points. Every backend
+// returns what a linear scan with a strict '<' comparison would, ties going
+// to the lowest index, so they can be swapped without changing results.
+// Queries are const and may come from any number of threads.
+class SpatialIndex
+{
+public:
+    virtual ~SpatialIndex() {}
+
+    // Typical distance between neighbouring points, such as the mean edge
+    // length of the mesh they come from. Backends that divide space into
+    // cells size them by it; set it before build().
+    virtual void setSpacing(float /*spacing*/) {}
+    virtual void build(const std::vector<glm::vec3> &points) = 0;
+
+    // Returns the index of the point closest to query, or -1 if the index
+    // is empty. Optionally reports the squared distance to it.
+    virtual int nearest(const glm::vec3 &query, float *distance2 = (float*) 0) const = 0;
+
+    // As nearest(), starting from hint, the index of a point believed to be
+    // close, such as the answer for a nearby earlier query, or -1. With
+    // epsilon > 0 the search may stop at a point up to 1 + epsilon times
+    // further away than the nearest. Backends that prune their search use
+    // the hint as the initial bound and prune by the epsilon; the rest are
+    // exact.
+    virtual int nearestFrom(const glm::vec3 &query, int /*hint*/, float /*epsilon*/ = 0.0f,
+                            float *distance2 = (float*) 0) const
+    {
+        return nearest(query, distance2);
+    }
+
+    virtual unsigned long size() const = 0;
+    bool empty() const { return size() == 0; }
+
+    // Writes the built index to path, for load() to map back in place of
+    // building it again. key identifies the points, normally a hash of them;
+    // load() rejects a file saved with another. Backends with nothing worth
+    // keeping return false from both.
+    virtual bool save(const char * /*path*/, uint64_t /*key*/) const { return false; }
+    virtual bool load(const char * /*path*/, uint64_t /*key*/) { return false; }
+
+    // new, unbuilt index of the given type; the caller deletes it
+    static SpatialIndex *create(SpatialIndexType type);
+    static const char *name(SpatialIndexType type);
+};
+
+#endif
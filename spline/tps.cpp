@@ -18,24 +18,31 @@
  *  about the suitability of this software for any purpose.
  *  It is provided "as is" without express or implied warranty.
  *
- *  TODO:
- *    - implement TPS approximation 3 as suggested in paper
- *      Gianluca Donato and Serge Belongie, 2002: "Approximation
- *      Methods for Thin Plate Spline Mappings and Principal Warps"
+ *  The approximate fit (--rank) follows the subsampling method of
+ *  Gianluca Donato and Serge Belongie, 2002: "Approximation Methods for
+ *  Thin Plate Spline Mappings and Principal Warps"
  */
 
 #include <boost/numeric/ublas/matrix.hpp>
+#include <Eigen/Dense>
+#include <Eigen/Eigenvalues>
 
 #include "linalg3d.h"
 #include "ludecomposition.h"
+#include "../objparser.hpp"
+#include "../tpswarp.hpp"
 
 #include <vector>
+#include <algorithm>
+#include <cfloat>
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <omp.h>
 
 using namespace boost::numeric::ublas;
 using namespace std;
@@ -43,35 +50,187 @@ using namespace std;
 double regularization = 0.0;
 double bending_energy = 0.0;
 
+// above this many control points the approximate fit is only checked
+// against the exact one when asked, as the exact one costs O(p^3)
+const unsigned EXACT_CHECK_LIMIT = 1000;
+
+// The TPS system reduced once so it can be solved at any regularization.
+// P = [Q1 Q2] [R; 0] by QR, and the side conditions P'w = 0 make w = Q2 g,
+// which leaves (Q2' K Q2 + mu I) g = Q2' V with mu = lambda a^2. With
+// Q2' K Q2 = H T H' for tridiagonal T, g = H y where (T + mu I) y = H' Q2' V,
+// so each lambda costs O(p) for its bending energy, residual and GCV score,
+// and O(p^2) for its weights.
+struct tps_spectrum
+{
+    double a;                   // mean edge length
+    Eigen::HouseholderQR<Eigen::MatrixXd> qr;           // of P
+    Eigen::Tridiagonalization<Eigen::MatrixXd> tri;     // of Q2' K Q2
+    Eigen::VectorXd diagonal;   // of T, p-4
+    Eigen::VectorXd offdiagonal;
+    Eigen::MatrixXd z;          // H' Q2' V, (p-4) x 3
+    Eigen::MatrixXd coupling;   // Q1' K Q2, 4 x (p-4)
+    Eigen::MatrixXd q1v;        // Q1' V, 4 x 3
+    Eigen::Matrix4d r;
+    std::vector<double> centers;
+};
+
+struct tps_sweep_point
+{
+    double lambda;
+    double energy;      // w' K w over the three coordinates, without the regularization
+    double residual;    // RMS distance of the warped control points from their targets
+    double gcv;         // generalised cross-validation score; lower is better
+};
+
 double tps_base_func(double r);
-template <typename T>
-bool invert(matrix<T> A, matrix<T> &Ainv);
-bool abslessthan(double left, double right);
-double maxabs(double left, double right);
-template <typename T>
-matrix<T> multiply(matrix<T> left, matrix<T> right);
-matrix<double> tps_transformation(  std::vector<Vec> control_points,
-                                    std::vector<Vec> data_points);
+bool tps_factor(const std::vector<Vec> &control_points, const std::vector<Vec> &targets, tps_spectrum &s);
+double tps_shifted_solve(const tps_spectrum &s, double mu, Eigen::MatrixXd &y);
+tps_sweep_point tps_evaluate(const tps_spectrum &s, double lambda);
+void tps_solve(const tps_spectrum &s, double lambda, TPSWarp &warp);
+double tps_choose_gcv(const tps_spectrum &s);
+bool tps_fit(const std::vector<Vec> &control_points, const std::vector<Vec> &targets, TPSWarp &warp);
+bool tps_fit_approx(const std::vector<Vec> &control_points, const std::vector<Vec> &targets,
+                    unsigned rank, TPSWarp &warp);
+void tps_report_error(const std::vector<Vec> &control_points, const std::vector<Vec> &targets,
+                      const TPSWarp &approx);
+void tps_warp_vertices(double *xyz, size_t count, void *context);
 std::vector<Vec> loadcontrolpoints(const char *filename);
-std::vector<Vec> loaddatapoints(const char *filename);
 
 
 int main(int argc, char *argv[])
 {
-    if (argc < 3)
+    // options before the files
+    bool use_float = false, use_scalar = false, check = false, sweep = false, gcv = false;
+    unsigned rank = 0;
+    while (argc > 1 && argv[1][0] == '-')
+    {
+        if (strcmp(argv[1], "--float") == 0)
+            use_float = true;
+        else if (strcmp(argv[1], "--scalar") == 0)
+            use_scalar = true;
+        else if (strcmp(argv[1], "--check") == 0)
+            check = true;
+        else if (strcmp(argv[1], "--sweep") == 0)
+            sweep = true;
+        else if (strcmp(argv[1], "--gcv") == 0)
+            gcv = true;
+        else if (argc > 2 && strcmp(argv[1], "--lambda") == 0)
+        {
+            regularization = atof(argv[2]);
+            argc--;
+            argv++;
+        }
+        else if (argc > 2 && strcmp(argv[1], "--rank") == 0)
+        {
+            rank = (unsigned) atoi(argv[2]);
+            argc--;
+            argv++;
+        }
+        else
+            break;
+        argc--;
+        argv++;
+    }
+
+    if (argc < 4 || ((sweep || gcv) && rank > 0))
     {
-        cerr << "Usage: ./tps <control points> <data points>" << endl;
+        cerr << "Usage: ./tps [--float] [--scalar] [--lambda L] [--sweep] [--gcv] [--rank M [--check]]" << endl;
+        cerr << "             <control points> <target points> <face data>" << endl;
+        cerr << "Writes the face warped to take each control point onto its target to stdout" << endl;
+        cerr << "--float sums the kernel terms in single precision; --scalar uses the exact reference path" << endl;
+        cerr << "--rank fits an approximate TPS with M basis points, reporting its error against the exact" << endl;
+        cerr << "fit for up to " << EXACT_CHECK_LIMIT << " control points, or always with --check" << endl;
+        cerr << "--lambda sets the regularization, which lets the warp miss the targets for a smoother result;" << endl;
+        cerr << "--sweep reports the bending energy and landmark residual over a range of lambda, and --gcv" << endl;
+        cerr << "picks lambda by generalised cross-validation. Both factor the exact system once, not with --rank" << endl;
         return -1;
     }
 
     std::vector<Vec> cp = loadcontrolpoints(argv[1]);
-    std::vector<Vec> dp = loaddatapoints(argv[2]);
-    cout << dp.size() << endl;
-    matrix<double> T = tps_transformation(cp, dp);
+    std::vector<Vec> tp = loadcontrolpoints(argv[2]);
+    if (cp.size() != tp.size() || cp.empty())
+    {
+        cerr << "Need as many target points as control points" << endl;
+        return -1;
+    }
 
-    cout << T.size1() << endl;
-    cout << T.size2() << endl;
+    TPSWarp warp;
+    double start = omp_get_wtime();
+    if (rank > 0 && rank < cp.size())
+    {
+        if (!tps_fit_approx(cp, tp, rank, warp))
+        {
+            cerr << "Singular matrix! Aborting." << endl;
+            return -1;
+        }
+        cerr << "Approximate fit with " << rank << " of " << cp.size() << " control points as basis: "
+             << omp_get_wtime() - start << "s" << endl;
+        cerr << "Bending energy: " << bending_energy << endl;
+        if (check || cp.size() <= EXACT_CHECK_LIMIT)
+            tps_report_error(cp, tp, warp);
+    }
+    else if (sweep || gcv)
+    {
+        tps_spectrum spectrum;
+        if (!tps_factor(cp, tp, spectrum))
+        {
+            cerr << "Control points are coplanar! Aborting." << endl;
+            return -1;
+        }
+        cerr << "Factored: " << omp_get_wtime() - start << "s" << endl;
+        if (sweep)
+        {
+            fprintf(stderr, "%12s %14s %14s %14s\n", "lambda", "bending", "residual", "GCV");
+            for ( int k=-24; k<=8; ++k )
+            {
+                tps_sweep_point point = tps_evaluate(spectrum, pow(10.0, k / 4.0));
+                fprintf(stderr, "%12.4g %14.6g %14.6g %14.6g\n", point.lambda, point.energy, point.residual, point.gcv);
+            }
+        }
+        if (gcv)
+        {
+            regularization = tps_choose_gcv(spectrum);
+            cerr << "Lambda chosen by GCV: " << regularization << endl;
+        }
+        tps_sweep_point point = tps_evaluate(spectrum, regularization);
+        tps_solve(spectrum, regularization, warp);
+        cerr << "Sweep and solve: " << omp_get_wtime() - start << "s" << endl;
+        cerr << "Lambda " << regularization << ": bending energy " << point.energy
+             << ", landmark residual " << point.residual << endl;
+    }
+    else
+    {
+        if (!tps_fit(cp, tp, warp))
+        {
+            cerr << "Singular matrix! Aborting." << endl;
+            return -1;
+        }
+        cerr << "Fit: " << omp_get_wtime() - start << "s" << endl;
+        cerr << "Bending energy: " << bending_energy << endl;
+    }
+    warp.setPrecision(use_float ? TPSWarp::PRECISION_FLOAT : TPSWarp::PRECISION_DOUBLE);
+    warp.setScalar(use_scalar);
+    cerr << "Warping with the " << (use_scalar ? "scalar" : TPSWarp::kernelName()) << " kernel in "
+         << (use_float ? "float" : "double") << endl;
 
+    FILE *infile = fopen(argv[3], "rb");
+    if (!infile)
+    {
+        cerr << "Could not open " << argv[3] << endl;
+        return -1;
+    }
+
+    // the vertex lines go out in large per-thread blocks, so no stream
+    // buffering or per-line flushing on our side
+    setvbuf(stdout, 0, _IOFBF, 1 << 20);
+    bool ok = objTransformStream(infile, stdout, tps_warp_vertices, &warp);
+    fclose(infile);
+    fflush(stdout);
+    if (!ok)
+    {
+        cerr << "Error while rewriting " << argv[3] << endl;
+        return -1;
+    }
     return 0;
 }
 
@@ -90,109 +249,187 @@ double tps_base_func(double r)
     return r*r * log(r);
 }
 
-template <typename T>
-bool invert(matrix<T> A, matrix<T> &Ainv)
+// Builds K and P and reduces the system, a few times the cost of one LU
+// solve of L. The reflections of the QR are applied to K rather than
+// formed, so only the tridiagonalisation is O(p^3).
+bool tps_factor(const std::vector<Vec> &control_points, const std::vector<Vec> &targets, tps_spectrum &s)
 {
-  unsigned n = A.size1();
-
-  if (n != A.size2())
-    return false;
+    unsigned p = control_points.size();
+    if (p <= 4)
+        return false;
 
-  Ainv = matrix<T>(n,n);
-  for (unsigned i = 0; i < n; i++)
-  {
-    for (unsigned j = 0; j < n; j++)
+    Eigen::MatrixXd mtx_k(p, p), mtx_p(p, 4), mtx_v(p, 3);
+    double a = 0.0;
+    long i;
+    #pragma omp parallel for reduction(+:a) schedule(dynamic, 16)
+    for ( i=0; i<(long) p; ++i )
     {
-      Ainv(i,j) = (T) 0;
+        mtx_k(i,i) = 0.0;
+        for ( unsigned j=i+1; j<p; ++j )
+        {
+            double elen = (control_points[i] - control_points[j]).len();
+            mtx_k(i,j) = mtx_k(j,i) = tps_base_func(elen);
+            a += elen * 2;
+        }
+        mtx_p(i,0) = 1.0;
+        mtx_p(i,1) = control_points[i].x;
+        mtx_p(i,2) = control_points[i].y;
+        mtx_p(i,3) = control_points[i].z;
+        mtx_v(i,0) = targets[i].x;
+        mtx_v(i,1) = targets[i].y;
+        mtx_v(i,2) = targets[i].z;
     }
-    Ainv(i,i) = (T) 1;
-  }
-
-  return (0 == LU_Solve(A, Ainv));
-}
-
-bool abslessthan(double left, double right)
-{
-    if (left < 0.0)
-        left = -left;
-    if (right < 0.0)
-        right = -right;
-    
-    if (left < right)
-        return true;
-    else
-        return false;
+    s.a = a / (double)(p*p);
+
+    s.qr.compute(mtx_p);
+    s.r = s.qr.matrixQR().topLeftCorner(4, 4).triangularView<Eigen::Upper>();
+    double scale = s.r.cwiseAbs().maxCoeff();
+    for ( int j=0; j<4; ++j )
+        if (!(fabs(s.r(j,j)) > 1e-10 * scale))
+            return false;
+
+    // Q' K Q; its lower right block is Q2' K Q2
+    Eigen::MatrixXd qkq = s.qr.householderQ().adjoint() * mtx_k;
+    qkq = qkq * s.qr.householderQ();
+    s.coupling = qkq.topRightCorner(4, p-4);
+    s.tri.compute(qkq.bottomRightCorner(p-4, p-4));
+    s.diagonal = s.tri.diagonal();
+    s.offdiagonal = s.tri.subDiagonal();
+
+    Eigen::MatrixXd qv = s.qr.householderQ().adjoint() * mtx_v;
+    s.q1v = qv.topRows(4);
+    s.z = s.tri.matrixQ().adjoint() * qv.bottomRows(p-4);
+
+    s.centers.resize(3 * p);
+    for ( unsigned j=0; j<p; ++j )
+    {
+        s.centers[3*j+0] = control_points[j].x;
+        s.centers[3*j+1] = control_points[j].y;
+        s.centers[3*j+2] = control_points[j].z;
+    }
+    return true;
 }
 
-double maxabs(double left, double right)
+// Solves (T + mu I) y = z by elimination down the diagonal, and returns the
+// trace of (T + mu I)^-1. Its diagonal comes from the pivots of eliminating
+// downwards and upwards: (A^-1)_ii = 1 / (down_i + up_i - A_ii).
+double tps_shifted_solve(const tps_spectrum &s, double mu, Eigen::MatrixXd &y)
 {
-    return abslessthan(left, right) ? right : left;
+    int n = s.diagonal.size();
+    const Eigen::VectorXd &e = s.offdiagonal;
+    Eigen::VectorXd down(n), up(n);
+    down(0) = s.diagonal(0) + mu;
+    for ( int i=1; i<n; ++i )
+        down(i) = s.diagonal(i) + mu - e(i-1)*e(i-1) / down(i-1);
+    up(n-1) = s.diagonal(n-1) + mu;
+    for ( int i=n-2; i>=0; --i )
+        up(i) = s.diagonal(i) + mu - e(i)*e(i) / up(i+1);
+
+    y = s.z;
+    for ( int i=1; i<n; ++i )
+        y.row(i) -= (e(i-1) / down(i-1)) * y.row(i-1);
+    y.row(n-1) /= down(n-1);
+    for ( int i=n-2; i>=0; --i )
+        y.row(i) = (y.row(i) - e(i) * y.row(i+1)) / down(i);
+
+    double trace = 0.0;
+    for ( int i=0; i<n; ++i )
+        trace += 1.0 / (down(i) + up(i) - (s.diagonal(i) + mu));
+    return trace;
 }
 
-template <typename T>
-matrix<T> multiply(matrix<T> left, matrix<T> right)
+// The bending energy of w = Q2 H y is y' T y. The control points miss their
+// targets by mu w, so the residual is mu^2 |y|^2, and the trace of I - A for
+// the GCV score is mu trace (T + mu I)^-1.
+tps_sweep_point tps_evaluate(const tps_spectrum &s, double lambda)
 {
-    unsigned nLeftRows = left.size1();
-    unsigned nLeftCols = left.size2();
-    unsigned nRightRows = right.size1();
-    unsigned nRightCols = right.size2();
-
-    // Check the columns in the left matrix against the rows in the right
-    if (nLeftCols != nRightRows)
-        return matrix<T>(0,0);
+    double mu = lambda * (s.a*s.a);
+    Eigen::MatrixXd y;
+    double trace = mu * tps_shifted_solve(s, mu, y);
 
-    // Initialize matrix to return
-    matrix<T> result(nLeftRows, nRightCols);
-
-    // Use the transpose of the right side matrix for spatial locality
-    matrix<T> rightTranspose(nRightCols, nRightRows);
-    for (unsigned i = 0; i < nRightRows; i++)
+    int n = s.diagonal.size();
+    double energy = 0.0;
+    for ( int i=0; i<n; ++i )
     {
-        for (unsigned j = 0; j < nRightCols; j++)
-        {
-            rightTranspose(j,i) = right(i,j);
-        }
+        energy += s.diagonal(i) * y.row(i).squaredNorm();
+        if (i+1 < n)
+            energy += 2.0 * s.offdiagonal(i) * y.row(i).dot(y.row(i+1));
     }
+    double residual = mu*mu * y.squaredNorm();
+
+    unsigned p = s.centers.size() / 3;
+    tps_sweep_point point;
+    point.lambda = lambda;
+    point.energy = energy;
+    point.residual = sqrt(residual / p);
+    point.gcv = trace > 0.0 ? p * residual / (trace*trace) : HUGE_VAL;
+    return point;
+}
 
-    double maxelem = 0.0;
+// Forms the weights for one lambda and hands them to the warp; the affine
+// part comes from Q1' (K + mu I) w + R c = Q1' V, where Q1' w = 0
+void tps_solve(const tps_spectrum &s, double lambda, TPSWarp &warp)
+{
+    double mu = lambda * (s.a*s.a);
+    unsigned p = s.centers.size() / 3;
+    Eigen::MatrixXd y;
+    tps_shifted_solve(s, mu, y);
+    Eigen::MatrixXd g = s.tri.matrixQ() * y;
+    Eigen::MatrixXd padded = Eigen::MatrixXd::Zero(p, 3);
+    padded.bottomRows(p-4) = g;
+    Eigen::MatrixXd w = s.qr.householderQ() * padded;
+    Eigen::MatrixXd c = s.r.triangularView<Eigen::Upper>().solve(s.q1v - s.coupling * g);
+
+    std::vector<double> weights(3 * (p+4));
+    for ( unsigned i=0; i<p; ++i )
+        for ( unsigned j=0; j<3; ++j )
+            weights[3*i+j] = w(i,j);
+    for ( unsigned i=0; i<4; ++i )
+        for ( unsigned j=0; j<3; ++j )
+            weights[3*(p+i)+j] = c(i,j);
+    warp.set(s.centers.data(), p, weights.data());
+    bending_energy = tps_evaluate(s, lambda).energy;
+}
 
-    // Perform matrix multiplication
-    for (unsigned i = 0; i < nLeftRows; i++)
+// Lambda with the lowest GCV score, from a scan over 1e-8 to 1e4 refined
+// by golden section search around the best step
+double tps_choose_gcv(const tps_spectrum &s)
+{
+    const double STEP = 0.05;
+    double best = -8.0, best_score = HUGE_VAL;
+    for ( double e=-8.0; e<=4.0 + 1e-9; e += STEP )
     {
-        for (unsigned j = 0; j < nRightCols; j++)
+        double score = tps_evaluate(s, pow(10.0, e)).gcv;
+        if (score < best_score)
         {
-            T sum = 0;
-            for (unsigned k = 0; k < nRightRows; k++)
-            {
-                sum += left(i,k) * rightTranspose(j,k);
-            }
-            result(i,j) = sum;
-            maxelem = maxabs(maxelem, sum);
+            best_score = score;
+            best = e;
         }
     }
 
-    double threshold = maxelem / 1000000.0;
-
-    for (unsigned i = 0; i < nLeftRows; i++)
+    const double GOLDEN = 0.5 * (sqrt(5.0) - 1.0);
+    double lo = best - STEP, hi = best + STEP;
+    for ( int k=0; k<40; ++k )
     {
-        for (unsigned j = 0; j < nRightCols; j++)
-        {
-            if (abslessthan(result(i,j), threshold))
-                result(i,j) = 0.0;
-        }
+        double m1 = hi - GOLDEN * (hi - lo), m2 = lo + GOLDEN * (hi - lo);
+        if (tps_evaluate(s, pow(10.0, m1)).gcv < tps_evaluate(s, pow(10.0, m2)).gcv)
+            hi = m2;
+        else
+            lo = m1;
     }
-
-    return result;
+    return pow(10.0, 0.5 * (lo + hi));
 }
 
-matrix<double> tps_transformation(  std::vector<Vec> control_points,
-                                    std::vector<Vec> data_points)
+// Solves L W = [targets; 0] for the weights with one LU factorisation of L,
+// (p+4) x (p+4). Neither L's inverse nor anything the size of the data is
+// formed; the data points are warped afterwards by TPSWarp.
+bool tps_fit(const std::vector<Vec> &control_points, const std::vector<Vec> &targets, TPSWarp &warp)
 {
     unsigned p = control_points.size();
-    unsigned n = data_points.size();
 
     // Allocate the matrix and vector
     matrix<double> mtx_l(p+4, p+4);
+    matrix<double> mtx_v(p+4, 3);
     matrix<double> mtx_orig_k(p, p);
 
     // Fill K (p x p, upper left of L) and calculate
@@ -218,8 +455,10 @@ matrix<double> tps_transformation(  std::vector<Vec> control_points,
     // Fill the rest of L
     for ( unsigned i=0; i<p; ++i )
     {
-    // diagonal: regularization parameters (lambda * a^2)
-    mtx_l(i,i) = mtx_orig_k(i,i) = regularization * (a*a);
+    // diagonal: regularization parameters (lambda * a^2); K itself
+    // keeps U(0) = 0 there, for the bending energy
+    mtx_l(i,i) = regularization * (a*a);
+    mtx_orig_k(i,i) = 0.0;
 
     // P (p x 4, upper right)
     mtx_l(i, p+0) = 1.0;
@@ -232,76 +471,292 @@ matrix<double> tps_transformation(  std::vector<Vec> control_points,
     mtx_l(p+1, i) = control_points[i].x;
     mtx_l(p+2, i) = control_points[i].y;
     mtx_l(p+3, i) = control_points[i].z;
+
+    // V: the target of each control point
+    mtx_v(i, 0) = targets[i].x;
+    mtx_v(i, 1) = targets[i].y;
+    mtx_v(i, 2) = targets[i].z;
     }
 
-    // O (4 x 4, lower right)
+    // O (4 x 4, lower right), and zeros below V
     for ( unsigned i=p; i<p+4; ++i )
+    {
         for ( unsigned j=p; j<p+4; ++j )
             mtx_l(i,j) = 0.0;
+        for ( unsigned j=0; j<3; ++j )
+            mtx_v(i,j) = 0.0;
+    }
+
+    // Solve the linear system "inplace"; mtx_v becomes W
+    if (0 != LU_Solve(mtx_l, mtx_v))
+        return false;
 
-    // Find L's inverse
-    matrix<double> mtx_linv(p+4,p+4);
-    if (!invert(mtx_l, mtx_linv))
+    std::vector<double> centers(3 * p);
+    for ( unsigned i=0; i<p; ++i )
     {
-        puts( "Singular matrix! Aborting." );
-        exit(1);
+        centers[3*i+0] = control_points[i].x;
+        centers[3*i+1] = control_points[i].y;
+        centers[3*i+2] = control_points[i].z;
     }
+    std::vector<double> weights(3 * (p+4));
+    for ( unsigned i=0; i<p+4; ++i )
+        for ( unsigned j=0; j<3; ++j )
+            weights[3*i+j] = mtx_v(i,j);
+    warp.set(centers.data(), p, weights.data());
+
+    // Bending energy of each coordinate, w' K w, summed
+    bending_energy = 0.0;
+    for ( unsigned j=0; j<3; ++j )
+        for ( unsigned i=0; i<p; ++i )
+            for ( unsigned k=0; k<p; ++k )
+                bending_energy += mtx_v(i,j) * mtx_orig_k(i,k) * mtx_v(k,j);
+
+    return true;
+}
 
-    // Find M
-    matrix<double> mtx_m(n,p+4);
-    for (unsigned j = 0; j < n; j++)
+// Approximate fit after Donato and Belongie's subsampling method: the
+// kernel is centred on only rank of the control points, picked far apart,
+// and fitted to all p targets by least squares, with the TPS side
+// conditions on its weights. Costs O(p rank^2 + rank^3) instead of O(p^3),
+// and the warp O(rank) per vertex instead of O(p).
+bool tps_fit_approx(const std::vector<Vec> &control_points, const std::vector<Vec> &targets,
+                    unsigned rank, TPSWarp &warp)
+{
+    unsigned p = control_points.size();
+    unsigned m = std::min(rank, p);
+
+    // farthest point sampling: each basis point is the control point
+    // furthest from those taken so far
+    std::vector<unsigned> basis;
+    std::vector<double> gap(p, DBL_MAX);
+    unsigned next = 0;
+    for ( unsigned j=0; j<m; ++j )
     {
-        for (unsigned i = 0; i < p; i++)
+        basis.push_back(next);
+        unsigned furthest = 0;
+        for ( unsigned i=0; i<p; ++i )
         {
-            mtx_m(j,i) = tps_base_func((data_points[j] - control_points[i]).len());
+            gap[i] = std::min(gap[i], (double) (control_points[i] - control_points[next]).len());
+            if (gap[i] > gap[furthest])
+                furthest = i;
         }
+        next = furthest;
+    }
 
-        mtx_m(j,p+0) = 1;
-        mtx_m(j,p+1) = data_points[j].x;
-        mtx_m(j,p+2) = data_points[j].y;
-        mtx_m(j,p+3) = data_points[j].z;
+    // K over the basis, with U(0) = 0 on the diagonal
+    matrix<double> mtx_orig_k(m, m);
+    for ( unsigned i=0; i<m; ++i )
+    {
+        mtx_orig_k(i,i) = 0.0;
+        for ( unsigned j=i+1; j<m; ++j )
+            mtx_orig_k(i,j) = mtx_orig_k(j,i) =
+                tps_base_func((control_points[basis[i]] - control_points[basis[j]]).len());
     }
 
-    matrix<double> transform = multiply(mtx_m, mtx_linv);
+    // mean edge length over all the control points, as tps_fit scales
+    // lambda by, so both fits regularize alike
+    double a = 0.0;
+    long i;
+    #pragma omp parallel for reduction(+:a) schedule(dynamic, 16)
+    for ( i=0; i<(long) p; ++i )
+        for ( unsigned j=i+1; j<p; ++j )
+            a += (control_points[i] - control_points[j]).len() * 2;
+    a /= (double)(p*p);
 
-    return transform;
+    // A (p x (m+4)): the kernel of every control point against the basis,
+    // then 1, x, y, z; stored by column so A'A is dot products of columns
+    unsigned cols = m + 4;
+    std::vector<double> mtx_a((size_t) p * cols);
+    #pragma omp parallel for
+    for ( i=0; i<(long) p; ++i )
+    {
+        for ( unsigned j=0; j<m; ++j )
+            mtx_a[(size_t) j*p + i] = tps_base_func((control_points[i] - control_points[basis[j]]).len());
+        mtx_a[(size_t) (m+0)*p + i] = 1.0;
+        mtx_a[(size_t) (m+1)*p + i] = control_points[i].x;
+        mtx_a[(size_t) (m+2)*p + i] = control_points[i].y;
+        mtx_a[(size_t) (m+3)*p + i] = control_points[i].z;
+    }
+
+    // Normal equations with the side conditions as Lagrange multipliers:
+    //
+    //   [ A'A + lambda a^2 K   P_b ] [ w  ]   [ A'V ]
+    //   [ P_b'                 0   ] [ mu ] = [ 0   ]
+    //
+    // where P_b holds 1, x, y, z of the basis points against their weights
+    matrix<double> mtx_n(cols+4, cols+4);
+    matrix<double> mtx_v(cols+4, 3);
+    long j;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for ( j=0; j<(long) cols; ++j )
+    {
+        const double *col_j = &mtx_a[(size_t) j*p];
+        for ( unsigned k=j; k<cols; ++k )
+        {
+            const double *col_k = &mtx_a[(size_t) k*p];
+            double sum = 0.0;
+            for ( unsigned r=0; r<p; ++r )
+                sum += col_j[r] * col_k[r];
+            mtx_n(j,k) = sum;
+        }
+        double sum_x = 0.0, sum_y = 0.0, sum_z = 0.0;
+        for ( unsigned r=0; r<p; ++r )
+        {
+            sum_x += col_j[r] * targets[r].x;
+            sum_y += col_j[r] * targets[r].y;
+            sum_z += col_j[r] * targets[r].z;
+        }
+        mtx_v(j,0) = sum_x;
+        mtx_v(j,1) = sum_y;
+        mtx_v(j,2) = sum_z;
+    }
+    for ( unsigned j=0; j<cols; ++j )
+        for ( unsigned k=0; k<j; ++k )
+            mtx_n(j,k) = mtx_n(k,j);
+    for ( unsigned j=0; j<m; ++j )
+        for ( unsigned k=0; k<m; ++k )
+            mtx_n(j,k) += regularization * (a*a) * mtx_orig_k(j,k);
+    for ( unsigned j=0; j<cols+4; ++j )
+        for ( unsigned k=cols; k<cols+4; ++k )
+            mtx_n(j,k) = mtx_n(k,j) = 0.0;
+    for ( unsigned j=0; j<m; ++j )
+    {
+        const Vec &b = control_points[basis[j]];
+        mtx_n(j, cols+0) = mtx_n(cols+0, j) = 1.0;
+        mtx_n(j, cols+1) = mtx_n(cols+1, j) = b.x;
+        mtx_n(j, cols+2) = mtx_n(cols+2, j) = b.y;
+        mtx_n(j, cols+3) = mtx_n(cols+3, j) = b.z;
+    }
+    for ( unsigned k=cols; k<cols+4; ++k )
+        for ( unsigned c=0; c<3; ++c )
+            mtx_v(k,c) = 0.0;
+
+    if (0 != LU_Solve(mtx_n, mtx_v))
+        return false;
+
+    std::vector<double> centers(3 * m);
+    for ( unsigned j=0; j<m; ++j )
+    {
+        centers[3*j+0] = control_points[basis[j]].x;
+        centers[3*j+1] = control_points[basis[j]].y;
+        centers[3*j+2] = control_points[basis[j]].z;
+    }
+    std::vector<double> weights(3 * cols);
+    for ( unsigned j=0; j<cols; ++j )
+        for ( unsigned c=0; c<3; ++c )
+            weights[3*j+c] = mtx_v(j,c);
+    warp.set(centers.data(), m, weights.data());
+
+    // Bending energy of the kernel weights, w' K w, summed
+    bending_energy = 0.0;
+    for ( unsigned c=0; c<3; ++c )
+        for ( unsigned j=0; j<m; ++j )
+            for ( unsigned k=0; k<m; ++k )
+                bending_energy += mtx_v(j,c) * mtx_orig_k(j,k) * mtx_v(k,c);
+
+    return true;
 }
 
-std::vector<Vec> loadcontrolpoints(const char *filename)
+// Prints how far the approximate warp leaves the control points from their
+// targets, and how far it is from the exact warp, at the control points and
+// on a 16^3 grid over their bounding box
+void tps_report_error(const std::vector<Vec> &control_points, const std::vector<Vec> &targets,
+                      const TPSWarp &approx)
 {
-    ifstream infile(filename);
-    string line;
-    std::vector<Vec> cp;
+    unsigned p = control_points.size();
+    const int GRID = 16;
+    Vec lo = control_points[0], hi = control_points[0];
+    for ( unsigned i=0; i<p; ++i )
+    {
+        lo.x = std::min(lo.x, control_points[i].x); hi.x = std::max(hi.x, control_points[i].x);
+        lo.y = std::min(lo.y, control_points[i].y); hi.y = std::max(hi.y, control_points[i].y);
+        lo.z = std::min(lo.z, control_points[i].z); hi.z = std::max(hi.z, control_points[i].z);
+    }
+    std::vector<double> points(3 * (p + GRID*GRID*GRID));
+    for ( unsigned i=0; i<p; ++i )
+    {
+        points[3*i+0] = control_points[i].x;
+        points[3*i+1] = control_points[i].y;
+        points[3*i+2] = control_points[i].z;
+    }
+    double *grid = &points[3*p];
+    for ( int x=0; x<GRID; ++x )
+        for ( int y=0; y<GRID; ++y )
+            for ( int z=0; z<GRID; ++z, grid += 3 )
+            {
+                grid[0] = lo.x + (hi.x - lo.x) * x / (GRID - 1);
+                grid[1] = lo.y + (hi.y - lo.y) * y / (GRID - 1);
+                grid[2] = lo.z + (hi.z - lo.z) * z / (GRID - 1);
+            }
 
-    float v0, v1, v2;
-    for (int i = 0; getline(infile, line); i++)
+    std::vector<double> warped = points;
+    approx.warp(warped.data(), warped.size() / 3);
+    double residual = 0.0, max_residual = 0.0;
+    for ( unsigned i=0; i<p; ++i )
     {
-        istringstream iss(line);
-        iss >> v0 >> v1 >> v2;
-        cp.push_back(Vec(v0, v1, v2));
+        double dx = warped[3*i] - targets[i].x, dy = warped[3*i+1] - targets[i].y, dz = warped[3*i+2] - targets[i].z;
+        double d2 = dx*dx + dy*dy + dz*dz;
+        residual += d2;
+        max_residual = std::max(max_residual, sqrt(d2));
     }
+    cerr << "Landmark residual: RMS " << sqrt(residual / p) << ", max " << max_residual << endl;
 
-    return cp;
+    double approx_energy = bending_energy;
+    TPSWarp exact;
+    double start = omp_get_wtime();
+    if (!tps_fit(control_points, targets, exact))
+    {
+        cerr << "Exact fit is singular" << endl;
+        bending_energy = approx_energy;
+        return;
+    }
+    cerr << "Exact fit: " << omp_get_wtime() - start << "s, bending energy " << bending_energy << endl;
+    bending_energy = approx_energy;
+
+    exact.warp(points.data(), points.size() / 3);
+    double max_landmark = 0.0, max_grid = 0.0, sum_grid = 0.0, max_motion = 0.0;
+    for ( size_t k=0; k<points.size() / 3; ++k )
+    {
+        double dx = warped[3*k] - points[3*k], dy = warped[3*k+1] - points[3*k+1], dz = warped[3*k+2] - points[3*k+2];
+        double d = sqrt(dx*dx + dy*dy + dz*dz);
+        if (k < p)
+        {
+            max_landmark = std::max(max_landmark, d);
+            const Vec &c = control_points[k];
+            double mx = points[3*k] - c.x, my = points[3*k+1] - c.y, mz = points[3*k+2] - c.z;
+            max_motion = std::max(max_motion, sqrt(mx*mx + my*my + mz*mz));
+        }
+        else
+        {
+            max_grid = std::max(max_grid, d);
+            sum_grid += d*d;
+        }
+    }
+    cerr << "Against the exact warp: max " << max_landmark << " at the control points, max " << max_grid
+         << " and RMS " << sqrt(sum_grid / (GRID*GRID*GRID)) << " on the grid; control points move up to "
+         << max_motion << endl;
 }
 
-std::vector<Vec> loaddatapoints(const char *filename)
+// Warps a batch of vertices for objTransformStream, which calls it from
+// several threads at once; each vertex costs O(p) and nothing is kept
+void tps_warp_vertices(double *xyz, size_t count, void *context)
+{
+    ((const TPSWarp *) context)->warp(xyz, count);
+}
+
+std::vector<Vec> loadcontrolpoints(const char *filename)
 {
     ifstream infile(filename);
-    string line, label;
-    std::vector<Vec> dp;
+    string line;
+    std::vector<Vec> cp;
 
     float v0, v1, v2;
     for (int i = 0; getline(infile, line); i++)
     {
         istringstream iss(line);
-        iss >> label;
-        if (label == "v")
-        {
-            iss >> v0 >> v1 >> v2;
-            dp.push_back(Vec(v0, v1, v2));
-        }
+        if (iss >> v0 >> v1 >> v2)
+            cp.push_back(Vec(v0, v1, v2));
     }
 
-    return dp;
+    return cp;
 }
-
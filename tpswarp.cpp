@@ -0,0 +1,270 @@
+#include "tpswarp.hpp"
+#include <math.h>
+#include <omp.h>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TPSWARP_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+    // points per step of each kernel, and the most any of them takes
+    const unsigned int FLOAT_LANES = 8;
+    const unsigned int DOUBLE_LANES = 4;
+    const unsigned int MAX_LANES = 8;
+
+    // points handed to one thread at a time by warp()
+    const long WARP_BLOCK = 256;
+
+    const double LN2 = 0.69314718055994530942;
+    const double SQRT2 = 1.41421356237309504880;
+
+#ifdef TPSWARP_X86
+    // d/2 log d = d (e ln2 / 2 + atanh(s)) for d = m 2^e with m in
+    // [sqrt(1/2), sqrt(2)) and s = (m - 1) / (m + 1), so |s| < 0.172 and the
+    // series atanh(s) = s (1 + s^2/3 + s^4/5 + ...) cut after s^8 leaves a
+    // relative error under 2^-28 in float. A zero distance gives 0 times a
+    // finite log, so needs no special case.
+    __attribute__((target("avx2,fma"), always_inline))
+    inline __m256 kernelFloat(__m256 d)
+    {
+        const __m256 one = _mm256_set1_ps(1.0f);
+        __m256i bits = _mm256_castps_si256(d);
+        __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+        __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x7fffff)),
+                                                       _mm256_castps_si256(one)));
+        __m256 high = _mm256_cmp_ps(m, _mm256_set1_ps((float) SQRT2), _CMP_GT_OQ);
+        m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), high);
+        e = _mm256_add_ps(e, _mm256_and_ps(high, one));
+
+        __m256 s = _mm256_div_ps(_mm256_sub_ps(m, one), _mm256_add_ps(m, one));
+        __m256 s2 = _mm256_mul_ps(s, s);
+        __m256 series = _mm256_set1_ps(1.0f / 9.0f);
+        series = _mm256_fmadd_ps(series, s2, _mm256_set1_ps(1.0f / 7.0f));
+        series = _mm256_fmadd_ps(series, s2, _mm256_set1_ps(1.0f / 5.0f));
+        series = _mm256_fmadd_ps(series, s2, _mm256_set1_ps(1.0f / 3.0f));
+        series = _mm256_fmadd_ps(series, s2, one);
+        __m256 halfLog = _mm256_fmadd_ps(e, _mm256_set1_ps((float) (0.5 * LN2)), _mm256_mul_ps(s, series));
+        return _mm256_mul_ps(d, halfLog);
+    }
+
+    // as kernelFloat(), with the series cut after s^18 for a relative error
+    // under 2^-55
+    __attribute__((target("avx2,fma"), always_inline))
+    inline __m256d kernelDouble(__m256d d)
+    {
+        const __m256d one = _mm256_set1_pd(1.0);
+        __m256i bits = _mm256_castpd_si256(d);
+        // the exponent field, converted by placing it in the mantissa of 2^52
+        __m256i field = _mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_castpd_si256(_mm256_set1_pd(4503599627370496.0)));
+        __m256d e = _mm256_sub_pd(_mm256_castsi256_pd(field), _mm256_set1_pd(4503599627370496.0 + 1023.0));
+        __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0xfffffffffffffll)),
+                                                        _mm256_castpd_si256(one)));
+        __m256d high = _mm256_cmp_pd(m, _mm256_set1_pd(SQRT2), _CMP_GT_OQ);
+        m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), high);
+        e = _mm256_add_pd(e, _mm256_and_pd(high, one));
+
+        __m256d s = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+        __m256d s2 = _mm256_mul_pd(s, s);
+        __m256d series = _mm256_set1_pd(1.0 / 19.0);
+        series = _mm256_fmadd_pd(series, s2, _mm256_set1_pd(1.0 / 17.0));
+        series = _mm256_fmadd_pd(series, s2, _mm256_set1_pd(1.0 / 15.0));
+        series = _mm256_fmadd_pd(series, s2, _mm256_set1_pd(1.0 / 13.0));
+        series = _mm256_fmadd_pd(series, s2, _mm256_set1_pd(1.0 / 11.0));
+        series = _mm256_fmadd_pd(series, s2, _mm256_set1_pd(1.0 / 9.0));
+        series = _mm256_fmadd_pd(series, s2, _mm256_set1_pd(1.0 / 7.0));
+        series = _mm256_fmadd_pd(series, s2, _mm256_set1_pd(1.0 / 5.0));
+        series = _mm256_fmadd_pd(series, s2, _mm256_set1_pd(1.0 / 3.0));
+        series = _mm256_fmadd_pd(series, s2, one);
+        __m256d halfLog = _mm256_fmadd_pd(e, _mm256_set1_pd(0.5 * LN2), _mm256_mul_pd(s, series));
+        return _mm256_mul_pd(d, halfLog);
+    }
+
+    // Kernel sums of 8 points against every control point; terms holds 6
+    // floats per control point as TPSWarp keeps them
+    __attribute__((target("avx2,fma")))
+    void sumFloatAVX2(const float *terms, unsigned int numPoints, const float *x, const float *y, const float *z,
+                      float *sumX, float *sumY, float *sumZ)
+    {
+        __m256 px = _mm256_loadu_ps(x), py = _mm256_loadu_ps(y), pz = _mm256_loadu_ps(z);
+        __m256 sx = _mm256_setzero_ps(), sy = sx, sz = sx;
+        for (unsigned int i = 0; i < numPoints; i++, terms += 6)
+        {
+            __m256 dx = _mm256_sub_ps(px, _mm256_broadcast_ss(terms));
+            __m256 dy = _mm256_sub_ps(py, _mm256_broadcast_ss(terms + 1));
+            __m256 dz = _mm256_sub_ps(pz, _mm256_broadcast_ss(terms + 2));
+            __m256 d = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dz, dz)));
+            __m256 u = kernelFloat(d);
+            sx = _mm256_fmadd_ps(u, _mm256_broadcast_ss(terms + 3), sx);
+            sy = _mm256_fmadd_ps(u, _mm256_broadcast_ss(terms + 4), sy);
+            sz = _mm256_fmadd_ps(u, _mm256_broadcast_ss(terms + 5), sz);
+        }
+        _mm256_storeu_ps(sumX, sx);
+        _mm256_storeu_ps(sumY, sy);
+        _mm256_storeu_ps(sumZ, sz);
+    }
+
+    // kernel sums of 4 points
+    __attribute__((target("avx2,fma")))
+    void sumDoubleAVX2(const double *terms, unsigned int numPoints, const double *x, const double *y, const double *z,
+                       double *sumX, double *sumY, double *sumZ)
+    {
+        __m256d px = _mm256_loadu_pd(x), py = _mm256_loadu_pd(y), pz = _mm256_loadu_pd(z);
+        __m256d sx = _mm256_setzero_pd(), sy = sx, sz = sx;
+        for (unsigned int i = 0; i < numPoints; i++, terms += 6)
+        {
+            __m256d dx = _mm256_sub_pd(px, _mm256_broadcast_sd(terms));
+            __m256d dy = _mm256_sub_pd(py, _mm256_broadcast_sd(terms + 1));
+            __m256d dz = _mm256_sub_pd(pz, _mm256_broadcast_sd(terms + 2));
+            __m256d d = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dz, dz)));
+            __m256d u = kernelDouble(d);
+            sx = _mm256_fmadd_pd(u, _mm256_broadcast_sd(terms + 3), sx);
+            sy = _mm256_fmadd_pd(u, _mm256_broadcast_sd(terms + 4), sy);
+            sz = _mm256_fmadd_pd(u, _mm256_broadcast_sd(terms + 5), sz);
+        }
+        _mm256_storeu_pd(sumX, sx);
+        _mm256_storeu_pd(sumY, sy);
+        _mm256_storeu_pd(sumZ, sz);
+    }
+#endif
+
+    bool selectKernel(const char **name)
+    {
+#ifdef TPSWARP_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        {
+            *name = "AVX2";
+            return true;
+        }
+#endif
+        *name = "scalar";
+        return false;
+    }
+
+    const char *s_kernelName = 0;
+    bool s_avx2 = selectKernel(&s_kernelName);
+}
+
+const char *TPSWarp::kernelName()
+{
+    return s_kernelName;
+}
+
+double TPSWarp::baseFunction(double r)
+{
+    if (r == 0.0)
+        return 0.0;
+    else
+        return r * r * log(r);
+}
+
+void TPSWarp::set(const double *centers, unsigned int numPoints, const double *weights)
+{
+    m_numPoints = numPoints;
+    for (int k = 0; k < 12; k++)
+        m_affine[k] = weights[3 * numPoints + k];
+    m_terms.resize(6 * numPoints);
+    m_termsFloat.resize(6 * numPoints);
+    for (unsigned int i = 0; i < numPoints; i++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            m_terms[6 * i + k] = centers[3 * i + k];
+            m_terms[6 * i + 3 + k] = weights[3 * i + k];
+        }
+    }
+    for (unsigned long k = 0; k < m_terms.size(); k++)
+        m_termsFloat[k] = (float) m_terms[k];
+}
+
+void TPSWarp::warp(double *xyz, size_t count) const
+{
+    long numBlocks = ((long) count + WARP_BLOCK - 1) / WARP_BLOCK;
+    long block;
+    #pragma omp parallel for schedule(dynamic, 1) if (numBlocks > 1 && !omp_in_parallel())
+    for (block = 0; block < numBlocks; block++)
+    {
+        size_t first = (size_t) (block * WARP_BLOCK);
+        warpBlock(xyz + 3 * first, std::min((size_t) WARP_BLOCK, count - first));
+    }
+}
+
+// Warps count points on the calling thread
+void TPSWarp::warpBlock(double *xyz, size_t count) const
+{
+    unsigned int lanes = m_precision == PRECISION_FLOAT ? FLOAT_LANES : DOUBLE_LANES;
+    for (size_t first = 0; first < count; first += lanes)
+    {
+        unsigned int n = (unsigned int) std::min((size_t) lanes, count - first);
+        double *p = xyz + 3 * first;
+        double sum[3][MAX_LANES];
+
+        if (m_scalar || !s_avx2)
+        {
+            for (unsigned int j = 0; j < n; j++)
+            {
+                sum[0][j] = sum[1][j] = sum[2][j] = 0.0;
+                for (unsigned int i = 0; i < m_numPoints; i++)
+                {
+                    const double *t = &m_terms[6 * i];
+                    double dx = p[3 * j] - t[0], dy = p[3 * j + 1] - t[1], dz = p[3 * j + 2] - t[2];
+                    double u = baseFunction(sqrt(dx * dx + dy * dy + dz * dz));
+                    sum[0][j] += u * t[3];
+                    sum[1][j] += u * t[4];
+                    sum[2][j] += u * t[5];
+                }
+            }
+        }
+#ifdef TPSWARP_X86
+        // a short last step repeats its last point in the spare lanes
+        else if (m_precision == PRECISION_FLOAT)
+        {
+            float x[FLOAT_LANES], y[FLOAT_LANES], z[FLOAT_LANES];
+            float sumX[FLOAT_LANES], sumY[FLOAT_LANES], sumZ[FLOAT_LANES];
+            for (unsigned int j = 0; j < FLOAT_LANES; j++)
+            {
+                const double *q = p + 3 * std::min(j, n - 1);
+                x[j] = (float) q[0];
+                y[j] = (float) q[1];
+                z[j] = (float) q[2];
+            }
+            sumFloatAVX2(m_termsFloat.data(), m_numPoints, x, y, z, sumX, sumY, sumZ);
+            for (unsigned int j = 0; j < n; j++)
+            {
+                sum[0][j] = sumX[j];
+                sum[1][j] = sumY[j];
+                sum[2][j] = sumZ[j];
+            }
+        }
+        else
+        {
+            double x[DOUBLE_LANES], y[DOUBLE_LANES], z[DOUBLE_LANES];
+            for (unsigned int j = 0; j < DOUBLE_LANES; j++)
+            {
+                const double *q = p + 3 * std::min(j, n - 1);
+                x[j] = q[0];
+                y[j] = q[1];
+                z[j] = q[2];
+            }
+            sumDoubleAVX2(m_terms.data(), m_numPoints, x, y, z, sum[0], sum[1], sum[2]);
+        }
+#endif
+
+        for (unsigned int j = 0; j < n; j++)
+        {
+            double *q = p + 3 * j;
+            double out[3];
+            for (int k = 0; k < 3; k++)
+                out[k] = m_affine[k] + m_affine[3 + k] * q[0] + m_affine[6 + k] * q[1] + m_affine[9 + k] * q[2] +
+                         sum[k][j];
+            q[0] = out[0];
+            q[1] = out[1];
+            q[2] = out[2];
+        }
+    }
+}
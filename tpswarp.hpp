@@ -0,0 +1,61 @@
+#ifndef TPSWARP_HPP
+#define TPSWARP_HPP
+
+#include <stddef.h>
+#include <vector>
+
+// Evaluates a fitted 3D thin plate spline at many points. Each output
+// coordinate is f(x) = a0 + a1 x + a2 y + a3 z + sum_i w_i U(|x - c_i|),
+// with U(r) = r^2 log r over the p control points c_i.
+//
+// Points are warped 8 at a time against every control point with AVX2 when
+// the CPU has it, picked at run time. U is taken as d/2 log d of the squared
+// distance d, so there is no square root, and the log comes from a short
+// series for log of the mantissa, 2 atanh((m - 1) / (m + 1)), truncated
+// below the rounding error of the chosen precision. The affine part is
+// always summed in double. Float sums lose accuracy as the weights grow and
+// cancel, as they do for many closely spaced landmarks, so suit previews.
+class TPSWarp
+{
+public:
+    enum Precision
+    {
+        PRECISION_FLOAT,    // 8 points per step, kernel terms summed in float
+        PRECISION_DOUBLE    // 4 points per step, all in double
+    };
+
+    TPSWarp() {}
+    ~TPSWarp() {}
+
+    // centers holds 3 values per control point; weights holds the (p+4) x 3
+    // solution of the TPS system row by row: the p kernel weights, then the
+    // constant and the x, y and z coefficients
+    void set(const double *centers, unsigned int numPoints, const double *weights);
+    void setPrecision(Precision precision) { m_precision = precision; }
+    // evaluate with the scalar reference path, one exact log per term
+    void setScalar(bool scalar) { m_scalar = scalar; }
+    unsigned int numPoints() const { return m_numPoints; }
+
+    // Warps count points in place, stored as consecutive x, y, z values.
+    // Blocks of points are spread over the OpenMP threads; when called from
+    // inside a parallel region, such as an objTransformStream callback, the
+    // calling thread does its share alone.
+    void warp(double *xyz, size_t count) const;
+
+    // the instruction set warp() uses: "AVX2" or "scalar"
+    static const char *kernelName();
+    static double baseFunction(double r);
+
+private:
+    void warpBlock(double *xyz, size_t count) const;
+
+    unsigned int m_numPoints = 0;
+    Precision m_precision = PRECISION_DOUBLE;
+    bool m_scalar = false;
+    double m_affine[12];                // constant, x, y, z rows of 3
+    // per control point: its x, y and z, then its weights for x, y and z
+    std::vector<double> m_terms;
+    std::vector<float> m_termsFloat;
+};
+
+#endif